@@ -47,22 +47,39 @@ void animSetup(ws2811_led_t *ledMatrix, int ledCount)
 }
 
 
-void animInitClear(int param1, int param2, int param3)
+// Sets every led to value, returns 1 if that changed any of them
+
+static int fillMatrix(ws2811_led_t value)
 {
-	int x;
+	int x, changed = 0;
+
+	for (x = 0; x < width; x ++ )
+	{
+		if ( matrix[x] != value )
+		{
+			matrix[x] = value;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
 
-	for (x = 0; x < width; x++)
-		matrix[x] = 0;
 
+int animInitClear(int param1, int param2, int param3)
+{
 	sleepTime = 0U;	// We're done, disable ahnimation
+
+	return fillMatrix(0);
 }
 
-void animInitFadeToClear(int param1, int param2, int param3)
+int animInitFadeToClear(int param1, int param2, int param3)
 {
 	// Do nothing because we're using the current leds
+	return 0;
 }
 
-void animIterateFadeToClear(int param1, int param2, int param3)
+int animIterateFadeToClear(int param1, int param2, int param3)
 {
 	int x, allZeros = 1, r, g, b;
 
@@ -84,46 +101,48 @@ void animIterateFadeToClear(int param1, int param2, int param3)
 	}
 
 	if ( allZeros )	sleepTime = 0UL;
+
+	return ! allZeros;
 }
 
-void animInitOrbit(int param1, int param2, int param3)
+int animInitOrbit(int param1, int param2, int param3)
 {
-	int x;
+	int x, changed;
 
-	for (x = 0; x < width; x ++ )
+	changed = fillMatrix(param1);
+
+	for (x = 0; x < 3 && x < width; x ++ )
 	{
-		matrix[x] = param1;
+		if ( matrix[x] != param2 )	changed = 1;
+		matrix[x] = param2;
 	}
 
-	matrix[0] = param2;
-	matrix[1] = param2;
-	matrix[2] = param2;
+	return changed;
 }
 
-void animIterateOrbit(int param1, int param2, int param3)
+int animIterateOrbit(int param1, int param2, int param3)
 {
-	int x, tmp;
+	int x, tmp, changed = 0;
 	
 	tmp = matrix[width-1];
 	for ( x = width-1 ; x > 0; x -- )
 	{
+		if ( matrix[x] != matrix[x-1] )	changed = 1;
 		matrix[x] = matrix[x-1];
 	}
 	matrix[0] = tmp;
+
+	return changed;
 }
 
-void animInitHeart(int param1, int param2, int param3)
+int animInitHeart(int param1, int param2, int param3)
 {
-	int x;
-
 	heartDirection = 1;
-	for (x = 0; x < width; x ++ )
-	{
-		matrix[x] = param1;
-	}
+
+	return fillMatrix(param1);
 }
 
-void animIterateHeart(int param1, int param2, int param3)
+int animIterateHeart(int param1, int param2, int param3)
 {
 	int x;
 
@@ -134,42 +153,32 @@ void animIterateHeart(int param1, int param2, int param3)
 
 	if ( matrix[0] >= param2 ) heartDirection = -1;
 	if ( matrix[0] <= param1 ) heartDirection = 1;
+
+	return param3 != 0;
 }
 
-void animInitFull(int param1, int param2, int param3)
+int animInitFull(int param1, int param2, int param3)
 {
-	int x;
-
-	for (x = 0; x < width; x ++ )
-	{
-		matrix[x] = param1;
-	}
+	return fillMatrix(param1);
 }
 
-void animInitFlashing(int param1, int param2, int param3)
+int animInitFlashing(int param1, int param2, int param3)
 {
-	int x;
-
 	flashing = 1;
-	for (x = 0; x < width; x ++ )
-	{
-		matrix[x] = param1;
-	}
+
+	return fillMatrix(param1);
 }
 
-void animIterateFlashing(int param1, int param2, int param3)
+int animIterateFlashing(int param1, int param2, int param3)
 {
-	int x, v;
+	int v;
 
 	flashing ^= 1;
 
 	if (flashing ) v = param1;
 	else	       v = param2;
 
-	for (x = 0; x < width; x ++ )
-	{
-		matrix[x] = v;
-	}
+	return fillMatrix(v);
 }
 
 
@@ -39,8 +39,8 @@ typedef struct _animation
 	int 	param1;				// Parameter provided to the functions
 	int 	param2;				// Parameter provided to the functions
 	int 	param3;				// Parameter provided to the functions
-	void    (*initFunc)(int,int,int);	// Initializes the buffer when animation is changed
-	void	(*iterateFunc)(int,int,int);	// Completes one iteration of the buffer
+	int     (*initFunc)(int,int,int);	// Initializes the buffer when animation is changed, returns 1 if the buffer changed
+	int	(*iterateFunc)(int,int,int);	// Completes one iteration of the buffer, returns 1 if the buffer changed
 } Animation;
 
 extern Animation animations[];
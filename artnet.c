@@ -0,0 +1,467 @@
+/*
+ * artnet.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "artnet.h"
+
+
+#define ARTNET_PROTOCOL_VERSION                  14
+
+// OpCodes, sent little endian
+#define ARTNET_OP_POLL                           0x2000
+#define ARTNET_OP_POLL_REPLY                     0x2100
+#define ARTNET_OP_DMX                            0x5000
+#define ARTNET_OP_SYNC                           0x5200
+
+// Offsets into the packets
+#define ARTNET_ID                                0
+#define ARTNET_OPCODE                            8
+#define ARTNET_PROT_VER                          10       // Big endian
+#define ARTNET_HDR_LEN                           12
+#define ARTNET_POLL_LEN                          12
+
+#define ARTNET_DMX_SEQ                           12
+#define ARTNET_DMX_PORT_ADDRESS                  14       // SubUni then Net, little endian
+#define ARTNET_DMX_LENGTH                        16       // Big endian
+#define ARTNET_DMX_DATA                          18
+
+#define ARTNET_POLL_REPLY_LEN                    239
+
+// Sequence numbers this far back are out of order packets, further back the controller restarted
+#define ARTNET_SEQ_WINDOW                        20
+
+static const uint8_t artnet_id[8] = "Art-Net";
+
+
+typedef struct
+{
+    uint8_t id[8];
+    uint16_t opcode;                             // Little endian
+    uint8_t ip[4];
+    uint16_t port;                               // Little endian
+    uint8_t vers_info_hi;
+    uint8_t vers_info_lo;
+    uint8_t net_switch;                          // Bits 14-8 of the port-addresses
+    uint8_t sub_switch;                          // Bits 7-4
+    uint8_t oem_hi;
+    uint8_t oem_lo;
+    uint8_t ubea_version;
+    uint8_t status1;
+    uint8_t esta_man_lo;
+    uint8_t esta_man_hi;
+    char short_name[18];
+    char long_name[64];
+    char node_report[64];
+    uint8_t num_ports_hi;
+    uint8_t num_ports_lo;
+    uint8_t port_types[4];
+    uint8_t good_input[4];
+    uint8_t good_output[4];
+    uint8_t sw_in[4];
+    uint8_t sw_out[4];                           // Bits 3-0 of the port-addresses
+    uint8_t acn_priority;
+    uint8_t sw_macro;
+    uint8_t sw_remote;
+    uint8_t spare[3];
+    uint8_t style;
+    uint8_t mac[6];
+    uint8_t bind_ip[4];
+    uint8_t bind_index;                          // 1 based number of this reply
+    uint8_t status2;
+    uint8_t good_output_b[4];
+    uint8_t status3;
+    uint8_t default_resp_uid[6];
+    uint8_t filler[15];
+} __attribute__((packed)) artnet_poll_reply_t;
+
+_Static_assert(sizeof(artnet_poll_reply_t) == ARTNET_POLL_REPLY_LEN, "ArtPollReply layout");
+
+#define ARTNET_PORT_TYPE_OUTPUT                  0x80     // Output from Art-Net, DMX512
+#define ARTNET_GOOD_OUTPUT_DATA                  0x80     // Data is being transmitted
+#define ARTNET_STATUS2_15BIT                     0x08     // Supports 15-bit port-addresses
+#define ARTNET_STYLE_NODE                        0x00
+
+
+static uint16_t get16le(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+/**
+ * Open the Art-Net socket.
+ *
+ * @param    artnet          Art-Net state.
+ * @param    universe        First 15-bit port-address.
+ * @param    universe_count  Number of universes.
+ * @param    format          WS2811_PIXEL_RGB888 or WS2811_PIXEL_RGBW8888.
+ * @param    count           Pixels per channel of the frames received.
+ *
+ * @returns  Socket fd on success, -1 otherwise.
+ */
+int artnet_open(artnet_t *artnet, int universe, int universe_count, int format, const int *count)
+{
+    struct sockaddr_in addr;
+    int optval = 1;
+
+    memset(artnet, 0, sizeof(*artnet));
+    artnet->sockfd = -1;
+
+    if ((universe < 0) || (universe_count < 1) || (universe_count > ARTNET_MAX_UNIVERSES) ||
+        (universe + universe_count - 1 > 0x7fff) || !frame_format_size(format))
+    {
+        fprintf(stderr, "invalid art-net universe range %d+%d\n", universe, universe_count);
+        return -1;
+    }
+
+    artnet->universe = universe;
+    artnet->universe_count = universe_count;
+    artnet->format = format;
+    artnet->pixels_per_universe = ARTNET_SLOTS / frame_format_size(format);
+
+    if (frame_alloc(&artnet->staged, count) < 0)
+    {
+        fprintf(stderr, "unable to allocate the art-net frame\n");
+        return -1;
+    }
+
+    artnet->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (artnet->sockfd < 0)
+    {
+        perror("unable to create art-net socket");
+        return -1;
+    }
+
+    // Controllers broadcast ArtDmx and ArtSync as often as they unicast them
+    if (setsockopt(artnet->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) ||
+        setsockopt(artnet->sockfd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) ||
+        (fcntl(artnet->sockfd, F_SETFL, fcntl(artnet->sockfd, F_GETFL) | O_NONBLOCK) < 0))
+    {
+        perror("unable to set art-net socket options");
+        artnet_close(artnet);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(ARTNET_PORT);
+
+    if (bind(artnet->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("unable to bind art-net socket");
+        artnet_close(artnet);
+        return -1;
+    }
+
+    return artnet->sockfd;
+}
+
+/**
+ * Close the Art-Net socket.
+ *
+ * @param    artnet  Art-Net state.
+ *
+ * @returns  None
+ */
+void artnet_close(artnet_t *artnet)
+{
+    if (artnet->sockfd >= 0)
+    {
+        close(artnet->sockfd);
+        artnet->sockfd = -1;
+    }
+
+    frame_free(&artnet->staged);
+}
+
+/**
+ * Find the address of the interface packets to a host leave from, which is
+ * the address to announce in ArtPollReply.
+ *
+ * @param    to      Host.
+ * @param    ip      Where to put the address.
+ *
+ * @returns  None
+ */
+static void artnet_local_address(const struct sockaddr_in *to, struct in_addr *ip)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd;
+
+    ip->s_addr = htonl(INADDR_ANY);
+
+    // Connecting a udp socket sends nothing, it only picks the route
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    if (!connect(fd, (const struct sockaddr *)to, sizeof(*to)) &&
+        !getsockname(fd, (struct sockaddr *)&addr, &addrlen))
+    {
+        *ip = addr.sin_addr;
+    }
+
+    close(fd);
+}
+
+/**
+ * Answer an ArtPoll.  Each ArtPollReply describes up to four outputs that
+ * share the upper 11 bits of their port-address, so the universe range
+ * takes as many replies as needed, numbered through BindIndex.  The replies
+ * are unicast to the controller.
+ *
+ * @param    artnet  Art-Net state.
+ * @param    from    Controller that sent the ArtPoll.
+ *
+ * @returns  None
+ */
+static void artnet_poll_reply(artnet_t *artnet, const struct sockaddr_in *from)
+{
+    struct sockaddr_in to = *from;
+    artnet_poll_reply_t reply;
+    struct in_addr ip;
+    int i, port, ports, bind_index = 1;
+
+    to.sin_port = htons(ARTNET_PORT);
+    artnet_local_address(&to, &ip);
+
+    for (i = 0; i < artnet->universe_count; i += ports, bind_index++)
+    {
+        uint16_t address = artnet->universe + i;
+
+        // Stop at four ports or when the Net/SubNet part changes
+        for (ports = 0; (ports < 4) && (i + ports < artnet->universe_count); ports++)
+        {
+            if (((address + ports) >> 4) != (address >> 4))
+            {
+                break;
+            }
+        }
+
+        memset(&reply, 0, sizeof(reply));
+        memcpy(reply.id, artnet_id, sizeof(reply.id));
+        reply.opcode = htole16(ARTNET_OP_POLL_REPLY);
+        memcpy(reply.ip, &ip, sizeof(reply.ip));
+        memcpy(reply.bind_ip, &ip, sizeof(reply.bind_ip));
+        reply.port = htole16(ARTNET_PORT);
+        reply.vers_info_lo = 1;
+        reply.net_switch = (address >> 8) & 0x7f;
+        reply.sub_switch = (address >> 4) & 0x0f;
+        strncpy(reply.short_name, "ws281x", sizeof(reply.short_name) - 1);
+        strncpy(reply.long_name, "rpi_ws281x udp server", sizeof(reply.long_name) - 1);
+        strncpy(reply.node_report, "#0001 [0000] Power On Tests successful", sizeof(reply.node_report) - 1);
+        reply.num_ports_lo = ports;
+        memset(reply.port_types, ARTNET_PORT_TYPE_OUTPUT, ports);
+        memset(reply.good_output, ARTNET_GOOD_OUTPUT_DATA, ports);
+        for (port = 0; port < ports; port++)
+        {
+            reply.sw_out[port] = (address + port) & 0x0f;
+        }
+        reply.style = ARTNET_STYLE_NODE;
+        reply.bind_index = bind_index;
+        reply.status2 = ARTNET_STATUS2_15BIT;
+
+        sendto(artnet->sockfd, &reply, sizeof(reply), 0, (const struct sockaddr *)&to, sizeof(to));
+    }
+}
+
+/**
+ * Finish the frame being received, copying it into the frame shown.
+ *
+ * @param    artnet  Art-Net state.
+ * @param    frame   Frame to show.
+ *
+ * @returns  None
+ */
+static void artnet_frame_done(artnet_t *artnet, frame_t *frame)
+{
+    frame_copy(frame, &artnet->staged);
+    artnet->pending = 0;
+}
+
+/**
+ * Handle an ArtDmx packet.
+ *
+ * @param    artnet  Art-Net state.
+ * @param    frame   Frame to show.
+ * @param    buf     Packet.
+ * @param    len     Packet length.
+ *
+ * @returns  1 if a frame is ready to be shown, 0 if not, -1 on a bad packet.
+ */
+static int artnet_receive_dmx(artnet_t *artnet, frame_t *frame, const uint8_t *buf, int len)
+{
+    uint8_t seq = buf[ARTNET_DMX_SEQ];
+    uint64_t bit;
+    int index, slots, ready;
+    struct timespec now;
+    int8_t age;
+
+    if (len < ARTNET_DMX_DATA)
+    {
+        return -1;
+    }
+
+    index = (get16le(&buf[ARTNET_DMX_PORT_ADDRESS]) & 0x7fff) - artnet->universe;
+    if ((index < 0) || (index >= artnet->universe_count))
+    {
+        return 0;
+    }
+    bit = 1ULL << index;
+
+    // Sequence 0 means the controller doesn't number its packets
+    age = seq - artnet->seq[index];
+    if (seq && artnet->seq[index] && (age <= 0) && (age > -ARTNET_SEQ_WINDOW))
+    {
+        return 0;
+    }
+    artnet->seq[index] = seq;
+
+    if (artnet->sync_mode)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - artnet->last_sync.tv_sec > ARTNET_SYNC_TIMEOUT)
+        {
+            artnet->sync_mode = 0;
+        }
+    }
+
+    // The universe showing up again means the sync (or the rest of the
+    // universes) for the frame it belonged to got lost, show what we have
+    // and start the next frame with it
+    ready = (artnet->pending & bit) != 0;
+    if (ready)
+    {
+        artnet_frame_done(artnet, frame);
+    }
+
+    slots = (buf[ARTNET_DMX_LENGTH] << 8) | buf[ARTNET_DMX_LENGTH + 1];
+    if (slots > len - ARTNET_DMX_DATA)
+    {
+        slots = len - ARTNET_DMX_DATA;
+    }
+    if (slots > artnet->pixels_per_universe * frame_format_size(artnet->format))
+    {
+        slots = artnet->pixels_per_universe * frame_format_size(artnet->format);
+    }
+
+    frame_write_linear(&artnet->staged, index * artnet->pixels_per_universe, artnet->format,
+                       &buf[ARTNET_DMX_DATA], slots);
+    artnet->pending |= bit;
+
+    if (!artnet->sync_mode &&
+        (artnet->pending == (~0ULL >> (ARTNET_MAX_UNIVERSES - artnet->universe_count))))
+    {
+        artnet_frame_done(artnet, frame);
+        ready = 1;
+    }
+
+    return ready;
+}
+
+/**
+ * Handle an ArtSync packet, switching to synchronous mode.
+ *
+ * @param    artnet  Art-Net state.
+ * @param    frame   Frame to show.
+ *
+ * @returns  1 if a frame is ready to be shown, 0 if not.
+ */
+static int artnet_receive_sync(artnet_t *artnet, frame_t *frame)
+{
+    artnet->sync_mode = 1;
+    clock_gettime(CLOCK_MONOTONIC, &artnet->last_sync);
+
+    if (!artnet->pending)
+    {
+        return 0;
+    }
+
+    artnet_frame_done(artnet, frame);
+
+    return 1;
+}
+
+/**
+ * Handle a packet received on the Art-Net socket, collecting ArtDmx data
+ * until a frame is ready and answering ArtPoll.
+ *
+ * @param    artnet  Art-Net state.
+ * @param    frame   Frame to write the ready frame into.
+ * @param    buf     Packet.
+ * @param    len     Packet length.
+ * @param    from    Sender of the packet.
+ *
+ * @returns  1 if a frame is ready to be shown, 0 if not, -1 on a bad packet or one without
+ *           pixel data.
+ */
+int artnet_receive(artnet_t *artnet, frame_t *frame, const uint8_t *buf, int len,
+                   const struct sockaddr_in *from)
+{
+    if ((len < ARTNET_HDR_LEN) || memcmp(&buf[ARTNET_ID], artnet_id, sizeof(artnet_id)))
+    {
+        return -1;
+    }
+
+    // ArtDmx, ArtSync and ArtPoll all carry the protocol version after the OpCode
+    if (((buf[ARTNET_PROT_VER] << 8) | buf[ARTNET_PROT_VER + 1]) < ARTNET_PROTOCOL_VERSION)
+    {
+        return -1;
+    }
+
+    switch (get16le(&buf[ARTNET_OPCODE]))
+    {
+        case ARTNET_OP_DMX:
+            return artnet_receive_dmx(artnet, frame, buf, len);
+
+        case ARTNET_OP_SYNC:
+            return artnet_receive_sync(artnet, frame);
+
+        case ARTNET_OP_POLL:
+            if ((len >= ARTNET_POLL_LEN) && from)
+            {
+                artnet_poll_reply(artnet, from);
+            }
+            return -1;
+    }
+
+    return -1;
+}
@@ -0,0 +1,80 @@
+/*
+ * artnet.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __ARTNET_H__
+#define __ARTNET_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "frame.h"
+
+
+/*
+ * Art-Net 4 node.  A range of consecutive 15-bit port-addresses is mapped
+ * onto the LEDs like the E1.31 universes are, 170 RGB or 128 RGBW pixels
+ * each starting from pixel 0 of channel 0.  Controllers find the node
+ * through ArtPoll, which is answered with one ArtPollReply per group of up
+ * to four outputs.
+ *
+ * Once an ArtSync is seen, ArtDmx data is held until the next ArtSync so
+ * every universe of a frame is shown with one render.  Without ArtSync for
+ * ARTNET_SYNC_TIMEOUT seconds the node goes back to showing a frame once
+ * every universe was received.
+ *
+ * Universes are collected in a frame of the node's own until the frame is
+ * ready, so the frame passed in only ever gets whole frames.
+ */
+#define ARTNET_PORT                              6454
+#define ARTNET_MAX_UNIVERSES                     64       // Universes tracked in a 64-bit mask
+#define ARTNET_SLOTS                             512      // DMX slots per universe
+#define ARTNET_SYNC_TIMEOUT                      4        // Seconds
+
+typedef struct
+{
+    int sockfd;
+    uint16_t universe;                           // First port-address
+    int universe_count;                          // Number of universes
+    int format;                                  // WS2811_PIXEL_xxx format of the slots
+    int pixels_per_universe;
+    uint8_t seq[ARTNET_MAX_UNIVERSES];           // Last sequence number per universe, 0 if unused
+    uint64_t pending;                            // Universes received since the last frame shown
+    int sync_mode;                               // Controller sends ArtSync
+    struct timespec last_sync;                   // When the last ArtSync arrived
+    frame_t staged;                              // Universes of the frame being received
+} artnet_t;
+
+
+int artnet_open(artnet_t *artnet, int universe, int universe_count, int format, const int *count);
+void artnet_close(artnet_t *artnet);
+int artnet_receive(artnet_t *artnet, frame_t *frame, const uint8_t *buf, int len,
+                   const struct sockaddr_in *from);
+
+#endif /* __ARTNET_H__ */
@@ -0,0 +1,495 @@
+/*
+ * asynclog.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE                              // strerror_r returning the message
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "asynclog.h"
+
+
+// Argument types, as the conversion takes them
+#define ASYNCLOG_INT                             0
+#define ASYNCLOG_LONG                            1
+#define ASYNCLOG_LLONG                           2
+#define ASYNCLOG_SIZE                            3
+#define ASYNCLOG_DOUBLE                          4
+#define ASYNCLOG_STRING                          5
+#define ASYNCLOG_POINTER                         6
+#define ASYNCLOG_NONE                            -1
+
+typedef union
+{
+    long long i;
+    size_t z;
+    double d;
+    const void *p;
+    int text;                                    // Offset of a %s string in the record text
+} asynclog_arg_t;
+
+typedef struct
+{
+    uint64_t seq;                                // Ring position the record holds, or is free for
+    FILE *stream;
+    const char *fmt;
+    int err;                                     // errno of asynclog_perror, fmt is what failed then
+    int count;                                   // Arguments
+    asynclog_arg_t arg[ASYNCLOG_ARGS];
+    char text[ASYNCLOG_TEXT];
+} asynclog_record_t;
+
+static asynclog_record_t ring[ASYNCLOG_SLOTS];
+static uint64_t head;                            // Next position a writer takes
+static uint64_t tail;                            // Next position the thread reads
+static unsigned long dropped;
+static volatile int running;
+static pthread_t thread;
+
+
+/**
+ * Find the next conversion in a format string.
+ *
+ * @param    fmt     Format string from the current position.
+ * @param    start   Set to the conversion's '%'.
+ * @param    end     Set past the conversion character.
+ *
+ * @returns  ASYNCLOG_xxx type of the argument it takes, ASYNCLOG_NONE if
+ *           there are no more, or for "%%" (with start and end set).
+ */
+static int asynclog_conversion(const char *fmt, const char **start, const char **end)
+{
+    int longs = 0, size = 0;
+
+    fmt = strchr(fmt, '%');
+    if (!fmt)
+    {
+        return ASYNCLOG_NONE;
+    }
+    *start = fmt++;
+
+    fmt += strspn(fmt, "-+ #0");
+    fmt += strspn(fmt, "0123456789");
+    if (*fmt == '.')
+    {
+        fmt++;
+        fmt += strspn(fmt, "0123456789");
+    }
+
+    for (; strchr("hlz", *fmt) && *fmt; fmt++)
+    {
+        longs += (*fmt == 'l');
+        size |= (*fmt == 'z');
+    }
+
+    *end = *fmt ? fmt + 1 : fmt;
+
+    switch (*fmt)
+    {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+            return size ? ASYNCLOG_SIZE : (longs > 1) ? ASYNCLOG_LLONG : longs ? ASYNCLOG_LONG : ASYNCLOG_INT;
+
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            return ASYNCLOG_DOUBLE;
+
+        case 's':
+            return ASYNCLOG_STRING;
+
+        case 'p':
+            return ASYNCLOG_POINTER;
+    }
+
+    return ASYNCLOG_NONE;
+}
+
+/**
+ * Take a free record at the head of the ring.
+ *
+ * @returns  Record to fill in, NULL if the ring is full.
+ */
+static asynclog_record_t *asynclog_claim(void)
+{
+    uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    asynclog_record_t *record;
+    int64_t diff;
+
+    for (;;)
+    {
+        record = &ring[pos & (ASYNCLOG_SLOTS - 1)];
+        diff = (int64_t)(__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0)
+        {
+            // Free for this position, unless another writer takes it first
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                return record;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Still holding the record from one lap ago
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Hand a filled in record to the thread.
+ *
+ * @param    record  Record from asynclog_claim().
+ *
+ * @returns  None
+ */
+static void asynclog_commit(asynclog_record_t *record)
+{
+    __atomic_store_n(&record->seq, record->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format a record into a line.
+ *
+ * @param    record  Record.
+ * @param    line    Line of ASYNCLOG_LINE bytes.
+ *
+ * @returns  None
+ */
+static void asynclog_format(const asynclog_record_t *record, char *line)
+{
+    const char *fmt = record->fmt, *start, *end;
+    char spec[32], error[128];
+    int len = 0, n = 0, type;
+
+    if (record->err >= 0)
+    {
+        snprintf(line, ASYNCLOG_LINE, "%s: %s\n", fmt, strerror_r(record->err, error, sizeof(error)));
+        return;
+    }
+
+    while ((type = asynclog_conversion(fmt, &start, &end)) != ASYNCLOG_NONE || strchr(fmt, '%'))
+    {
+        len += snprintf(line + len, ASYNCLOG_LINE - len, "%.*s", (int)(start - fmt), fmt);
+        len = (len < ASYNCLOG_LINE) ? len : ASYNCLOG_LINE - 1;
+
+        snprintf(spec, sizeof(spec), "%.*s", (int)(end - start), start);
+        fmt = end;
+
+        if ((type == ASYNCLOG_NONE) || (n == record->count))
+        {
+            // "%%", or a conversion that wasn't captured
+            len += snprintf(line + len, ASYNCLOG_LINE - len, "%s", (spec[1] == '%') ? "%" : spec);
+        }
+        else
+        {
+            switch (type)
+            {
+                case ASYNCLOG_INT:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, (int)record->arg[n].i);
+                    break;
+
+                case ASYNCLOG_LONG:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, (long)record->arg[n].i);
+                    break;
+
+                case ASYNCLOG_LLONG:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, record->arg[n].i);
+                    break;
+
+                case ASYNCLOG_SIZE:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, record->arg[n].z);
+                    break;
+
+                case ASYNCLOG_DOUBLE:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, record->arg[n].d);
+                    break;
+
+                case ASYNCLOG_STRING:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, &record->text[record->arg[n].text]);
+                    break;
+
+                case ASYNCLOG_POINTER:
+                    len += snprintf(line + len, ASYNCLOG_LINE - len, spec, record->arg[n].p);
+                    break;
+            }
+            n++;
+        }
+        len = (len < ASYNCLOG_LINE) ? len : ASYNCLOG_LINE - 1;
+    }
+
+    snprintf(line + len, ASYNCLOG_LINE - len, "%s", fmt);
+}
+
+/**
+ * Write out the records waiting, and the count of messages dropped if it
+ * went up.
+ *
+ * @returns  Number of records written.
+ */
+static int asynclog_drain(void)
+{
+    static unsigned long reported;
+    asynclog_record_t *record;
+    char line[ASYNCLOG_LINE];
+    unsigned long lost;
+    int n = 0;
+
+    for (;;)
+    {
+        record = &ring[tail & (ASYNCLOG_SLOTS - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != tail + 1)
+        {
+            break;
+        }
+
+        asynclog_format(record, line);
+        fputs(line, record->stream);
+
+        // Free for the writer one lap on
+        __atomic_store_n(&record->seq, tail + ASYNCLOG_SLOTS, __ATOMIC_RELEASE);
+        tail++;
+        n++;
+    }
+
+    lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost != reported)
+    {
+        fprintf(stderr, "%lu log messages dropped, the log couldn't keep up\n", lost - reported);
+        reported = lost;
+    }
+
+    if (n)
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    return n;
+}
+
+static void *asynclog_loop(void *arg __attribute__((unused)))
+{
+    struct timespec poll = { 0, ASYNCLOG_POLL_MS * 1000000L };
+
+    // Formatting and writing out wait for everything else
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), ASYNCLOG_NICE);
+
+    while (running)
+    {
+        if (!asynclog_drain())
+        {
+            nanosleep(&poll, NULL);
+        }
+    }
+
+    asynclog_drain();
+
+    return NULL;
+}
+
+/**
+ * Start the thread writing out messages.
+ *
+ * @returns  None
+ */
+void asynclog_start(void)
+{
+    int i;
+
+    for (i = 0; i < ASYNCLOG_SLOTS; i++)
+    {
+        ring[i].seq = i;
+    }
+    head = tail = 0;
+
+    running = 1;
+    if (pthread_create(&thread, NULL, asynclog_loop, NULL))
+    {
+        running = 0;
+    }
+}
+
+/**
+ * Write out the messages waiting and stop the thread.  Messages after this
+ * are written right away.
+ *
+ * @returns  None
+ */
+void asynclog_stop(void)
+{
+    if (!running)
+    {
+        return;
+    }
+
+    running = 0;
+    pthread_join(thread, NULL);
+}
+
+/**
+ * Log a message, printf style.
+ *
+ * @param    stream  stdout or stderr.
+ * @param    fmt     Format, which has to stay valid until it's written out.
+ *
+ * @returns  None
+ */
+void asynclog(FILE *stream, const char *fmt, ...)
+{
+    asynclog_record_t *record;
+    const char *start, *end, *s;
+    int type, text = 0, len;
+    va_list ap;
+
+    va_start(ap, fmt);
+
+    if (!running)
+    {
+        vfprintf(stream, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    record = asynclog_claim();
+    if (!record)
+    {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+
+    record->stream = stream;
+    record->fmt = fmt;
+    record->err = -1;
+    record->count = 0;
+
+    while ((record->count < ASYNCLOG_ARGS) &&
+           ((type = asynclog_conversion(fmt, &start, &end)) != ASYNCLOG_NONE || strchr(fmt, '%')))
+    {
+        fmt = end;
+
+        switch (type)
+        {
+            case ASYNCLOG_NONE:
+                continue;
+
+            case ASYNCLOG_INT:
+                record->arg[record->count].i = va_arg(ap, int);
+                break;
+
+            case ASYNCLOG_LONG:
+                record->arg[record->count].i = va_arg(ap, long);
+                break;
+
+            case ASYNCLOG_LLONG:
+                record->arg[record->count].i = va_arg(ap, long long);
+                break;
+
+            case ASYNCLOG_SIZE:
+                record->arg[record->count].z = va_arg(ap, size_t);
+                break;
+
+            case ASYNCLOG_DOUBLE:
+                record->arg[record->count].d = va_arg(ap, double);
+                break;
+
+            case ASYNCLOG_STRING:
+                // Strings are cut short rather than dropped when they don't fit
+                s = va_arg(ap, const char *);
+                s = s ? s : "(null)";
+                len = strnlen(s, ASYNCLOG_TEXT - 1 - text);
+                memcpy(&record->text[text], s, len);
+                record->text[text + len] = 0;
+                record->arg[record->count].text = text;
+                text += (text + len < ASYNCLOG_TEXT - 1) ? len + 1 : len;
+                break;
+
+            case ASYNCLOG_POINTER:
+                record->arg[record->count].p = va_arg(ap, const void *);
+                break;
+        }
+        record->count++;
+    }
+
+    va_end(ap);
+    asynclog_commit(record);
+}
+
+/**
+ * Log what failed with the errno message, perror style.
+ *
+ * @param    what    What failed, which has to stay valid until it's written out.
+ *
+ * @returns  None
+ */
+void asynclog_perror(const char *what)
+{
+    asynclog_record_t *record;
+    int err = errno;
+
+    if (!running)
+    {
+        fprintf(stderr, "%s: %s\n", what, strerror(err));
+        return;
+    }
+
+    record = asynclog_claim();
+    if (!record)
+    {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record->stream = stderr;
+    record->fmt = what;
+    record->err = err;
+    record->count = 0;
+    asynclog_commit(record);
+}
+
+/**
+ * Number of messages dropped with the ring full.
+ *
+ * @returns  Messages dropped.
+ */
+unsigned long asynclog_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+/*
+ * asynclog.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __ASYNCLOG_H__
+#define __ASYNCLOG_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+/*
+ * Logging that never blocks the caller.  A message is a fixed-size record:
+ * the format string, which has to stay valid (a literal), and the arguments
+ * as they were, with %s strings copied into the record.  Records go into a
+ * lock-free ring any thread can write, and a low-priority thread formats
+ * and writes them out.  When the ring is full the message is dropped and
+ * counted, the count is logged once there's room again.
+ *
+ * Conversions supported are d, i, u, o, x, X, c, e, f, g, a (either case),
+ * s and p, with flags, a width and precision given as digits, and the hh, h,
+ * l, ll and z lengths.  While the thread isn't running messages are written
+ * right away.
+ */
+#define ASYNCLOG_SLOTS                           256      // Records in the ring, a power of 2
+#define ASYNCLOG_ARGS                            8        // Arguments per message
+#define ASYNCLOG_TEXT                            160      // Bytes of %s strings per message
+#define ASYNCLOG_LINE                            512      // Longest message written
+#define ASYNCLOG_POLL_MS                         10       // The thread looks for messages this often
+#define ASYNCLOG_NICE                            10       // Niceness of the thread
+
+void asynclog_start(void);
+void asynclog_stop(void);
+void asynclog(FILE *stream, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void asynclog_perror(const char *what);
+unsigned long asynclog_dropped(void);
+
+#endif /* __ASYNCLOG_H__ */
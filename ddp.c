@@ -0,0 +1,292 @@
+/*
+ * ddp.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ddp.h"
+
+
+// Offsets into the header
+#define DDP_FLAGS                                0
+#define DDP_TYPE                                 2
+#define DDP_ID                                   3
+#define DDP_OFFSET                               4        // Big endian byte offset
+#define DDP_LENGTH                               8        // Big endian data length
+#define DDP_HDR_LEN                              10
+#define DDP_TIMECODE_LEN                         4        // Follows the header with DDP_FLAG_TIMECODE
+
+#define DDP_FLAG_VERSION_MASK                    0xc0
+#define DDP_FLAG_VERSION_1                       0x40
+#define DDP_FLAG_TIMECODE                        0x10
+#define DDP_FLAG_STORAGE                         0x08
+#define DDP_FLAG_REPLY                           0x04
+#define DDP_FLAG_QUERY                           0x02
+#define DDP_FLAG_PUSH                            0x01
+
+#define DDP_ID_DISPLAY                           1        // Default output device
+#define DDP_ID_ALL                               255
+
+// Data type is CRTTTSSS: customer defined, reserved, type, bits per element
+#define DDP_TYPE_UNDEFINED                       0x00
+#define DDP_TYPE_TYPE(type)                      (((type) >> 3) & 0x07)
+#define DDP_TYPE_SIZE(type)                      ((type) & 0x07)
+#define DDP_TYPE_RGB                             1
+#define DDP_TYPE_RGBW                            3
+#define DDP_TYPE_SIZE_8BIT                       3
+
+
+static uint32_t get32(const uint8_t *buf)
+{
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/**
+ * Open the DDP socket.
+ *
+ * @param    ddp     DDP state.
+ * @param    port    Udp port, normally DDP_PORT.
+ * @param    format  WS2811_PIXEL_xxx format of packets that don't say.
+ * @param    count   Pixels per channel of the frames received.
+ *
+ * @returns  Socket fd on success, -1 otherwise.
+ */
+int ddp_open(ddp_t *ddp, int port, int format, const int *count)
+{
+    struct sockaddr_in addr;
+    int optval = 1;
+
+    memset(ddp, 0, sizeof(*ddp));
+    ddp->sockfd = -1;
+    ddp->format = format;
+
+    if (frame_alloc(&ddp->staged, count) < 0)
+    {
+        fprintf(stderr, "unable to allocate the ddp frame\n");
+        return -1;
+    }
+
+    ddp->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ddp->sockfd < 0)
+    {
+        perror("unable to create ddp socket");
+        ddp_close(ddp);
+        return -1;
+    }
+
+    if (setsockopt(ddp->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) ||
+        (fcntl(ddp->sockfd, F_SETFL, fcntl(ddp->sockfd, F_GETFL) | O_NONBLOCK) < 0))
+    {
+        perror("unable to set ddp socket options");
+        ddp_close(ddp);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(ddp->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("unable to bind ddp socket");
+        ddp_close(ddp);
+        return -1;
+    }
+
+    return ddp->sockfd;
+}
+
+/**
+ * Close the DDP socket.
+ *
+ * @param    ddp     DDP state.
+ *
+ * @returns  None
+ */
+void ddp_close(ddp_t *ddp)
+{
+    if (ddp->sockfd >= 0)
+    {
+        close(ddp->sockfd);
+        ddp->sockfd = -1;
+    }
+
+    frame_free(&ddp->staged);
+}
+
+/**
+ * Pixel format of a DDP data type.
+ *
+ * @param    ddp     DDP state.
+ * @param    type    DDP data type byte.
+ *
+ * @returns  WS2811_PIXEL_xxx format, -1 if the type can't be shown.
+ */
+static int ddp_format(ddp_t *ddp, uint8_t type)
+{
+    if (type == DDP_TYPE_UNDEFINED)
+    {
+        return ddp->format;
+    }
+
+    if ((DDP_TYPE_SIZE(type) != DDP_TYPE_SIZE_8BIT) && (DDP_TYPE_SIZE(type) != 0))
+    {
+        return -1;
+    }
+
+    switch (DDP_TYPE_TYPE(type))
+    {
+        case DDP_TYPE_RGB:
+            return WS2811_PIXEL_RGB888;
+
+        case DDP_TYPE_RGBW:
+            return WS2811_PIXEL_RGBW8888;
+    }
+
+    return -1;
+}
+
+/**
+ * Write data at a byte offset into the frame.  Offsets needn't fall on a
+ * pixel boundary, a pixel split over two packets is completed from the
+ * bytes kept from the previous packet.
+ *
+ * @param    ddp     DDP state.
+ * @param    frame   Frame to write into.
+ * @param    format  WS2811_PIXEL_xxx format of data.
+ * @param    offset  Byte offset of data.
+ * @param    data    Pixel data.
+ * @param    len     Length of data in bytes.
+ *
+ * @returns  None
+ */
+static void ddp_write(ddp_t *ddp, frame_t *frame, int format, uint32_t offset,
+                      const uint8_t *data, int len)
+{
+    int size = frame_format_size(format);
+    int skip = (size - offset % size) % size;
+    int pixels;
+
+    if (skip)
+    {
+        if (ddp->carry_len && (ddp->carry_offset + ddp->carry_len == offset) &&
+            (ddp->carry_len + skip == size) && (len >= skip))
+        {
+            memcpy(&ddp->carry[ddp->carry_len], data, skip);
+            frame_write_linear(frame, ddp->carry_offset / size, format, ddp->carry, size);
+        }
+
+        if (len < skip)
+        {
+            ddp->carry_len = 0;
+            return;
+        }
+
+        data += skip;
+        len -= skip;
+        offset += skip;
+    }
+
+    pixels = len / size;
+    frame_write_linear(frame, offset / size, format, data, pixels * size);
+
+    // Keep a trailing partial pixel for the next packet
+    ddp->carry_len = len - pixels * size;
+    ddp->carry_offset = offset + pixels * size;
+    memcpy(ddp->carry, &data[pixels * size], ddp->carry_len);
+}
+
+/**
+ * Handle a packet received on the DDP socket.  Its data is collected until
+ * a packet with the push flag, which copies the frame into the one shown.
+ *
+ * @param    ddp     DDP state.
+ * @param    frame   Frame to write the pushed frame into.
+ * @param    buf     Packet.
+ * @param    len     Packet length.
+ *
+ * @returns  1 if the packet pushed a frame to be shown, 0 if not, -1 on a bad packet or one
+ *           without pixel data.
+ */
+int ddp_receive(ddp_t *ddp, frame_t *frame, const uint8_t *buf, int len)
+{
+    uint8_t flags = buf[DDP_FLAGS];
+    int hdr_len = DDP_HDR_LEN;
+    int data_len, format;
+
+    if ((len < DDP_HDR_LEN) || ((flags & DDP_FLAG_VERSION_MASK) != DDP_FLAG_VERSION_1))
+    {
+        return -1;
+    }
+
+    // Queries, replies and other destinations (config, status) don't carry pixels
+    if ((flags & (DDP_FLAG_QUERY | DDP_FLAG_REPLY)) ||
+        ((buf[DDP_ID] != DDP_ID_DISPLAY) && (buf[DDP_ID] != DDP_ID_ALL)))
+    {
+        return -1;
+    }
+
+    if (flags & DDP_FLAG_TIMECODE)
+    {
+        hdr_len += DDP_TIMECODE_LEN;
+    }
+
+    format = ddp_format(ddp, buf[DDP_TYPE]);
+    if ((len < hdr_len) || (format < 0))
+    {
+        return -1;
+    }
+
+    data_len = (buf[DDP_LENGTH] << 8) | buf[DDP_LENGTH + 1];
+    if (data_len > len - hdr_len)
+    {
+        data_len = len - hdr_len;
+    }
+
+    if (data_len)
+    {
+        ddp_write(ddp, &ddp->staged, format, get32(&buf[DDP_OFFSET]), &buf[hdr_len], data_len);
+    }
+
+    if (!(flags & DDP_FLAG_PUSH))
+    {
+        return 0;
+    }
+
+    frame_copy(frame, &ddp->staged);
+
+    return 1;
+}
@@ -0,0 +1,63 @@
+/*
+ * ddp.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __DDP_H__
+#define __DDP_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Distributed Display Protocol receiver.  Each packet carries pixel data
+ * for a byte offset into the LEDs, seen as one string running from channel
+ * 0 into channel 1.  The frame is shown when a packet with the push flag
+ * arrives, so senders decide when a frame is complete.  Packets are written
+ * into a frame of the receiver's own until then, so the frame passed in
+ * only ever gets whole frames.
+ */
+#define DDP_PORT                                 4048
+
+typedef struct
+{
+    int sockfd;
+    int format;                                  // WS2811_PIXEL_xxx format for untyped data
+    uint8_t carry[4];                            // Start of a pixel split over two packets
+    int carry_len;                               // Bytes in carry, 0 if none
+    uint32_t carry_offset;                       // Byte offset of the pixel in carry
+    frame_t staged;                              // Frame being received
+} ddp_t;
+
+
+int ddp_open(ddp_t *ddp, int port, int format, const int *count);
+void ddp_close(ddp_t *ddp);
+int ddp_receive(ddp_t *ddp, frame_t *frame, const uint8_t *buf, int len);
+
+#endif /* __DDP_H__ */
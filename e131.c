@@ -0,0 +1,470 @@
+/*
+ * e131.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "e131.h"
+
+
+// Offsets into the root layer
+#define E131_ROOT_PREAMBLE                       0
+#define E131_ROOT_ACN_ID                         4
+#define E131_ROOT_VECTOR                         18
+#define E131_ROOT_LEN                            38
+
+#define E131_VECTOR_ROOT_DATA                    0x00000004
+#define E131_VECTOR_ROOT_EXTENDED                0x00000008
+
+// Offsets into a data packet
+#define E131_DATA_VECTOR                         40
+#define E131_DATA_SYNC_ADDRESS                   109
+#define E131_DATA_SEQ                            111
+#define E131_DATA_OPTIONS                        112
+#define E131_DATA_UNIVERSE                       113
+#define E131_DATA_DMP_VECTOR                     117
+#define E131_DATA_COUNT                          123
+#define E131_DATA_START_CODE                     125
+#define E131_DATA_SLOTS                          126
+
+#define E131_VECTOR_DATA_PACKET                  0x00000002
+#define E131_VECTOR_DMP_SET_PROPERTY             0x02
+
+#define E131_OPTION_PREVIEW                      0x80     // Meant for visualizers, not the LEDs
+#define E131_OPTION_TERMINATED                   0x40     // Source stopped sending this universe
+
+// Offsets into a synchronization packet
+#define E131_SYNC_VECTOR                         40
+#define E131_SYNC_SEQ                            44
+#define E131_SYNC_ADDRESS                        45
+#define E131_SYNC_LEN                            49
+
+#define E131_VECTOR_EXTENDED_SYNC                0x00000001
+
+// Sequence numbers this far back are out of order packets, further back the source restarted
+#define E131_SEQ_WINDOW                          20
+
+static const uint8_t e131_acn_id[12] = "ASC-E1.17\0\0";
+
+
+static uint16_t get16(const uint8_t *buf)
+{
+    return (buf[0] << 8) | buf[1];
+}
+
+static uint32_t get32(const uint8_t *buf)
+{
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/**
+ * Join or leave the multicast group of a universe, 239.255.<hi>.<lo>.
+ *
+ * @param    e131      E1.31 state.
+ * @param    universe  Universe number.
+ * @param    option    IP_ADD_MEMBERSHIP or IP_DROP_MEMBERSHIP.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int e131_membership(e131_t *e131, uint16_t universe, int option)
+{
+    struct ip_mreq mreq =
+    {
+        .imr_multiaddr.s_addr = htonl(0xefff0000 | universe),
+        .imr_interface.s_addr = htonl(INADDR_ANY),
+    };
+
+    return setsockopt(e131->sockfd, IPPROTO_IP, option, &mreq, sizeof(mreq));
+}
+
+/**
+ * Open an E1.31 socket and join the multicast groups of the universes.
+ *
+ * @param    e131            E1.31 state.
+ * @param    universe        First universe, 1 - 63999.
+ * @param    universe_count  Number of universes.
+ * @param    format          WS2811_PIXEL_RGB888 or WS2811_PIXEL_RGBW8888.
+ * @param    first_pixel     Pixel the first universe starts at.
+ * @param    count           Pixels per channel to stage frames in, NULL to
+ *                           write universes straight into the frame.
+ * @param    shard           Nonzero to share the port with other shards.
+ *
+ * @returns  Socket fd on success, -1 otherwise.
+ */
+static int e131_setup(e131_t *e131, int universe, int universe_count, int format, int first_pixel,
+                      const int *count, int shard)
+{
+    struct sockaddr_in addr;
+    int optval = 1;
+    int off = 0;
+    int i;
+
+    memset(e131, 0, sizeof(*e131));
+    e131->sockfd = -1;
+
+    if ((universe < 1) || (universe_count < 1) || (universe_count > E131_MAX_UNIVERSES) ||
+        (universe + universe_count - 1 > 63999) || !frame_format_size(format))
+    {
+        fprintf(stderr, "invalid e1.31 universe range %d+%d\n", universe, universe_count);
+        return -1;
+    }
+
+    e131->universe = universe;
+    e131->universe_count = universe_count;
+    e131->format = format;
+    e131->pixels_per_universe = E131_SLOTS / frame_format_size(format);
+    e131->first_pixel = first_pixel;
+
+    if (count && (frame_alloc(&e131->staged, count) < 0))
+    {
+        fprintf(stderr, "unable to allocate the e1.31 frame\n");
+        return -1;
+    }
+
+    e131->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (e131->sockfd < 0)
+    {
+        perror("unable to create e1.31 socket");
+        return -1;
+    }
+
+    if (setsockopt(e131->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) ||
+        (shard && setsockopt(e131->sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) ||
+        (shard && setsockopt(e131->sockfd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off))) ||
+        (fcntl(e131->sockfd, F_SETFL, fcntl(e131->sockfd, F_GETFL) | O_NONBLOCK) < 0))
+    {
+        perror("unable to set e1.31 socket options");
+        e131_close(e131);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(E131_PORT);
+
+    if (bind(e131->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("unable to bind e1.31 socket");
+        e131_close(e131);
+        return -1;
+    }
+
+    for (i = 0; i < universe_count; i++)
+    {
+        if (e131_membership(e131, universe + i, IP_ADD_MEMBERSHIP))
+        {
+            fprintf(stderr, "unable to join multicast group of universe %d, unicast only\n", universe + i);
+        }
+    }
+
+    return e131->sockfd;
+}
+
+/**
+ * Open the E1.31 socket and join the multicast groups of the universes.
+ * The socket also takes unicast packets, so failing to join a group (the
+ * kernel allows 20 per socket by default, see igmp_max_memberships) is
+ * reported but not fatal.
+ *
+ * @param    e131            E1.31 state.
+ * @param    universe        First universe, 1 - 63999.
+ * @param    universe_count  Number of universes.
+ * @param    format          WS2811_PIXEL_RGB888 or WS2811_PIXEL_RGBW8888.
+ * @param    count           Pixels per channel of the frames received.
+ *
+ * @returns  Socket fd on success, -1 otherwise.
+ */
+int e131_open(e131_t *e131, int universe, int universe_count, int format, const int *count)
+{
+    return e131_setup(e131, universe, universe_count, format, 0, count, 0);
+}
+
+/**
+ * Open a shard of a universe range.  Its socket shares the E1.31 port with
+ * the other shards and takes only the multicast groups it joined, so it
+ * sees the packets of its own universes.  Unicast packets go to one of the
+ * shards by the sender's address, the others' universes in them are dropped.
+ *
+ * @param    e131            E1.31 state.
+ * @param    universe        First universe of the shard.
+ * @param    universe_count  Number of universes in the shard.
+ * @param    format          WS2811_PIXEL_RGB888 or WS2811_PIXEL_RGBW8888.
+ * @param    first_pixel     Pixel the shard's first universe starts at.
+ *
+ * @returns  Socket fd on success, -1 otherwise.
+ */
+int e131_open_shard(e131_t *e131, int universe, int universe_count, int format, int first_pixel)
+{
+    // The shard set holds the frame until every shard is done with it
+    return e131_setup(e131, universe, universe_count, format, first_pixel, NULL, 1);
+}
+
+/**
+ * Close the E1.31 socket, leaving its multicast groups.
+ *
+ * @param    e131    E1.31 state.
+ *
+ * @returns  None
+ */
+void e131_close(e131_t *e131)
+{
+    if (e131->sockfd >= 0)
+    {
+        close(e131->sockfd);
+        e131->sockfd = -1;
+    }
+
+    frame_free(&e131->staged);
+}
+
+/**
+ * Follow the sync address sources put in their data packets, joining its
+ * multicast group unless it's one of our universes already.
+ *
+ * @param    e131          E1.31 state.
+ * @param    sync_address  Sync address from a data packet.
+ *
+ * @returns  None
+ */
+static void e131_set_sync_address(e131_t *e131, uint16_t sync_address)
+{
+    if (sync_address == e131->sync_address)
+    {
+        return;
+    }
+
+    e131->sync_address = sync_address;
+
+    if (e131->sync_joined)
+    {
+        e131_membership(e131, e131->sync_joined, IP_DROP_MEMBERSHIP);
+        e131->sync_joined = 0;
+    }
+
+    if (sync_address && ((sync_address < e131->universe) ||
+                         (sync_address >= e131->universe + e131->universe_count)))
+    {
+        if (e131_membership(e131, sync_address, IP_ADD_MEMBERSHIP) == 0)
+        {
+            e131->sync_joined = sync_address;
+        }
+    }
+}
+
+/**
+ * Frame universes are written into, the staged frame unless there isn't one.
+ *
+ * @param    e131    E1.31 state.
+ * @param    frame   Frame to show.
+ *
+ * @returns  Frame to write into.
+ */
+static frame_t *e131_target(e131_t *e131, frame_t *frame)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (e131->staged.leds[chan])
+        {
+            return &e131->staged;
+        }
+    }
+
+    return frame;
+}
+
+/**
+ * Finish the frame being received, copying it into the frame shown unless
+ * universes are written there directly.
+ *
+ * @param    e131    E1.31 state.
+ * @param    frame   Frame to show.
+ *
+ * @returns  None
+ */
+static void e131_frame_done(e131_t *e131, frame_t *frame)
+{
+    if (e131_target(e131, frame) != frame)
+    {
+        frame_copy(frame, &e131->staged);
+    }
+
+    e131->pending = 0;
+}
+
+/**
+ * Handle a data packet.
+ *
+ * @param    e131    E1.31 state.
+ * @param    frame   Frame to show.
+ * @param    buf     Packet.
+ * @param    len     Packet length.
+ *
+ * @returns  1 if a frame is ready to be shown, 0 if not, -1 on a bad packet.
+ */
+static int e131_receive_data(e131_t *e131, frame_t *frame, const uint8_t *buf, int len)
+{
+    uint16_t universe = get16(&buf[E131_DATA_UNIVERSE]);
+    uint8_t options = buf[E131_DATA_OPTIONS];
+    uint8_t seq = buf[E131_DATA_SEQ];
+    uint64_t bit;
+    int index, slots, ready;
+    int8_t age;
+
+    if ((len < E131_DATA_SLOTS) ||
+        (get32(&buf[E131_DATA_VECTOR]) != E131_VECTOR_DATA_PACKET) ||
+        (buf[E131_DATA_DMP_VECTOR] != E131_VECTOR_DMP_SET_PROPERTY))
+    {
+        return -1;
+    }
+
+    index = universe - e131->universe;
+    if ((index < 0) || (index >= e131->universe_count) ||
+        (buf[E131_DATA_START_CODE] != 0) || (options & E131_OPTION_PREVIEW))
+    {
+        return 0;
+    }
+    bit = 1ULL << index;
+
+    age = seq - e131->seq[index];
+    if ((e131->seq_valid & bit) && (age <= 0) && (age > -E131_SEQ_WINDOW))
+    {
+        return 0;
+    }
+    e131->seq[index] = seq;
+    e131->seq_valid |= bit;
+
+    if (options & E131_OPTION_TERMINATED)
+    {
+        e131->seq_valid &= ~bit;
+        e131_set_sync_address(e131, 0);
+        return 0;
+    }
+
+    e131_set_sync_address(e131, get16(&buf[E131_DATA_SYNC_ADDRESS]));
+
+    // The universe showing up again means the sync (or the rest of the
+    // universes) for the frame it belonged to got lost, show what we have
+    // and start the next frame with it
+    ready = (e131->pending & bit) != 0;
+    if (ready)
+    {
+        e131_frame_done(e131, frame);
+    }
+
+    slots = get16(&buf[E131_DATA_COUNT]) - 1;
+    if (slots > len - E131_DATA_SLOTS)
+    {
+        slots = len - E131_DATA_SLOTS;
+    }
+    if (slots > e131->pixels_per_universe * frame_format_size(e131->format))
+    {
+        slots = e131->pixels_per_universe * frame_format_size(e131->format);
+    }
+
+    frame_write_linear(e131_target(e131, frame), e131->first_pixel + index * e131->pixels_per_universe,
+                       e131->format, &buf[E131_DATA_SLOTS], slots);
+    e131->pending |= bit;
+
+    if (!e131->sync_address &&
+        (e131->pending == (~0ULL >> (E131_MAX_UNIVERSES - e131->universe_count))))
+    {
+        e131_frame_done(e131, frame);
+        ready = 1;
+    }
+
+    return ready;
+}
+
+/**
+ * Handle a synchronization packet.
+ *
+ * @param    e131    E1.31 state.
+ * @param    frame   Frame to show.
+ * @param    buf     Packet.
+ * @param    len     Packet length.
+ *
+ * @returns  1 if a frame is ready to be shown, 0 if not, -1 on a bad packet.
+ */
+static int e131_receive_sync(e131_t *e131, frame_t *frame, const uint8_t *buf, int len)
+{
+    if ((len < E131_SYNC_LEN) || (get32(&buf[E131_SYNC_VECTOR]) != E131_VECTOR_EXTENDED_SYNC))
+    {
+        return -1;
+    }
+
+    if (!e131->sync_address || (get16(&buf[E131_SYNC_ADDRESS]) != e131->sync_address) ||
+        !e131->pending)
+    {
+        return 0;
+    }
+
+    e131_frame_done(e131, frame);
+
+    return 1;
+}
+
+/**
+ * Handle a packet received on the E1.31 socket.  Universe data is collected
+ * until a frame is ready, and then copied into the frame.
+ *
+ * @param    e131    E1.31 state.
+ * @param    frame   Frame to write the ready frame into.
+ * @param    buf     Packet.
+ * @param    len     Packet length.
+ *
+ * @returns  1 if a frame is ready to be shown, 0 if not, -1 on a bad packet.
+ */
+int e131_receive(e131_t *e131, frame_t *frame, const uint8_t *buf, int len)
+{
+    if ((len < E131_ROOT_LEN) || (get16(&buf[E131_ROOT_PREAMBLE]) != 0x0010) ||
+        memcmp(&buf[E131_ROOT_ACN_ID], e131_acn_id, sizeof(e131_acn_id)))
+    {
+        return -1;
+    }
+
+    switch (get32(&buf[E131_ROOT_VECTOR]))
+    {
+        case E131_VECTOR_ROOT_DATA:
+            return e131_receive_data(e131, frame, buf, len);
+
+        case E131_VECTOR_ROOT_EXTENDED:
+            return e131_receive_sync(e131, frame, buf, len);
+    }
+
+    return -1;
+}
@@ -0,0 +1,81 @@
+/*
+ * e131.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __E131_H__
+#define __E131_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * E1.31 (Streaming ACN) receiver.  A range of consecutive universes is
+ * mapped onto the LEDs, the first universe starting at pixel 0 of channel 0
+ * and running on into channel 1 once channel 0 is full.  Each universe
+ * carries 170 RGB or 128 RGBW pixels.
+ *
+ * Universes sent with a synchronization address are held until the
+ * matching sync packet arrives, so a frame spread over several universes is
+ * shown in one go.  Without synchronization a frame is shown once every
+ * universe in the range was received.  Universes are collected in a frame
+ * of the receiver's own until then, so the frame passed in only ever gets
+ * whole frames.
+ *
+ * A range can be split into shards, each with a socket of its own on the
+ * E1.31 port.  A shard's socket only takes the multicast groups it joined,
+ * so the kernel hands each its own universes.
+ */
+#define E131_PORT                                5568
+#define E131_MAX_UNIVERSES                       64       // Universes tracked in a 64-bit mask
+#define E131_SLOTS                               512      // DMX slots per universe
+
+typedef struct
+{
+    int sockfd;                                  // Socket joined to the universe groups
+    uint16_t universe;                           // First universe
+    int universe_count;                          // Number of universes
+    int format;                                  // WS2811_PIXEL_xxx format of the slots
+    int pixels_per_universe;
+    int first_pixel;                             // Pixel the first universe starts at
+    uint8_t seq[E131_MAX_UNIVERSES];             // Last sequence number per universe
+    uint64_t seq_valid;                          // Universes with a valid seq[]
+    uint64_t pending;                            // Universes received since the last frame shown
+    uint16_t sync_address;                       // Universe sync packets are expected on, 0 for none
+    uint16_t sync_joined;                        // Sync universe whose group was joined
+    frame_t staged;                              // Universes of the frame being received
+} e131_t;
+
+
+int e131_open(e131_t *e131, int universe, int universe_count, int format, const int *count);
+int e131_open_shard(e131_t *e131, int universe, int universe_count, int format, int first_pixel);
+void e131_close(e131_t *e131);
+int e131_receive(e131_t *e131, frame_t *frame, const uint8_t *buf, int len);
+
+#endif /* __E131_H__ */
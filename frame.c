@@ -0,0 +1,395 @@
+/*
+ * frame.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+
+
+/**
+ * Bytes per pixel of a network pixel format.  The formats share their
+ * numbering with the WS2811_PIXEL_xxx library formats, WS2811_PIXEL_LED
+ * being the little endian 0xWWRRGGBB words the LED buffers hold.
+ *
+ * @param    format  WS2811_PIXEL_xxx format.
+ *
+ * @returns  Bytes per pixel, 0 if the format can't be sent over the network.
+ */
+int frame_format_size(int format)
+{
+    switch (format)
+    {
+        case WS2811_PIXEL_LED:
+        case WS2811_PIXEL_RGBW8888:
+            return 4;
+
+        case WS2811_PIXEL_RGB888:
+        case WS2811_PIXEL_GRB888:
+            return 3;
+    }
+
+    return 0;
+}
+
+/**
+ * Write pixel data into a channel of a frame, converting it to
+ * ws2811_led_t on the way.  Pixels past the end of the channel are dropped.
+ *
+ * @param    frame   Frame to write into.
+ * @param    chan    Channel number.
+ * @param    offset  First pixel to write.
+ * @param    format  WS2811_PIXEL_xxx format of data.
+ * @param    data    Pixel data.
+ * @param    len     Length of data in bytes.
+ *
+ * @returns  Number of pixels written, -1 on a bad channel or format.
+ */
+int frame_write(frame_t *frame, int chan, int offset, int format, const uint8_t *data, int len)
+{
+    int size = frame_format_size(format);
+    ws2811_led_t *leds;
+    int count, i;
+
+    if ((chan < 0) || (chan >= RPI_PWM_CHANNELS) || !frame->leds[chan] || !size || (offset < 0))
+    {
+        return -1;
+    }
+
+    if (offset >= frame->count[chan])
+    {
+        return 0;
+    }
+
+    count = len / size;
+    if (count > frame->count[chan] - offset)
+    {
+        count = frame->count[chan] - offset;
+    }
+    leds = &frame->leds[chan][offset];
+
+    switch (format)
+    {
+        case WS2811_PIXEL_LED:
+            // Same layout as the LED buffer on the (little endian) Pi
+            memcpy(leds, data, count * sizeof(ws2811_led_t));
+            break;
+
+        case WS2811_PIXEL_RGB888:
+            for (i = 0; i < count; i++, data += 3)
+            {
+                leds[i] = (data[0] << 16) | (data[1] << 8) | data[2];
+            }
+            break;
+
+        case WS2811_PIXEL_GRB888:
+            for (i = 0; i < count; i++, data += 3)
+            {
+                leds[i] = (data[1] << 16) | (data[0] << 8) | data[2];
+            }
+            break;
+
+        case WS2811_PIXEL_RGBW8888:
+            for (i = 0; i < count; i++, data += 4)
+            {
+                leds[i] = ((uint32_t)data[3] << 24) | (data[0] << 16) | (data[1] << 8) | data[2];
+            }
+            break;
+    }
+
+    return count;
+}
+
+/**
+ * Decode run-length encoded pixel data into a channel of a frame, in
+ * place, so pixels that are skipped keep what the frame held before.
+ * Pixels past the end of the channel are dropped.
+ *
+ * @param    frame   Frame to write into.
+ * @param    chan    Channel number.
+ * @param    offset  First pixel the ops apply to, pixels before 0 are dropped too.
+ * @param    format  WS2811_PIXEL_xxx format of the pixels in data.
+ * @param    data    FRAME_OP_xxx ops and their pixels.
+ * @param    len     Length of data in bytes.
+ *
+ * @returns  Number of pixels the ops covered, -1 on a bad channel, format or op.
+ */
+int frame_decode(frame_t *frame, int chan, int offset, int format, const uint8_t *data, int len)
+{
+    int size = frame_format_size(format);
+    const uint8_t *end = data + len;
+    ws2811_led_t *leds, pixel;
+    int pos = offset;
+    int count, first, last, i;
+    uint8_t op;
+
+    if ((chan < 0) || (chan >= RPI_PWM_CHANNELS) || !frame->leds[chan] || !size)
+    {
+        return -1;
+    }
+    leds = frame->leds[chan];
+
+    while (data < end)
+    {
+        op = *data++;
+        count = (op & FRAME_OP_COUNT) + 1;
+
+        switch (op & FRAME_OP_MASK)
+        {
+            case FRAME_OP_SKIP:
+                break;
+
+            case FRAME_OP_LONG_SKIP:
+                if (data == end)
+                {
+                    return -1;
+                }
+                count = (((op & FRAME_OP_COUNT) << 8) | *data++) + 1;
+                break;
+
+            case FRAME_OP_LITERAL:
+                if (end - data < count * size)
+                {
+                    return -1;
+                }
+
+                first = (pos < 0) ? -pos : 0;
+                if (first < count)
+                {
+                    frame_write(frame, chan, pos + first, format, data + first * size, (count - first) * size);
+                }
+                data += count * size;
+                break;
+
+            case FRAME_OP_RUN:
+                if (end - data < size)
+                {
+                    return -1;
+                }
+
+                first = (pos < 0) ? 0 : pos;
+                if ((pos + count > 0) && (frame_write(frame, chan, first, format, data, size) > 0))
+                {
+                    last = pos + count;
+                    if (last > frame->count[chan])
+                    {
+                        last = frame->count[chan];
+                    }
+
+                    pixel = leds[first];
+                    for (i = first + 1; i < last; i++)
+                    {
+                        leds[i] = pixel;
+                    }
+                }
+                data += size;
+                break;
+        }
+
+        pos += count;
+    }
+
+    return pos - offset;
+}
+
+/**
+ * Write pixel data at a pixel position counted across the channels, so
+ * data running past the end of channel 0 continues at the start of
+ * channel 1.  Used by the DMX style protocols that see the LEDs as one
+ * long string.
+ *
+ * @param    frame   Frame to write into.
+ * @param    pixel   First pixel to write, counted across the channels.
+ * @param    format  WS2811_PIXEL_xxx format of data.
+ * @param    data    Pixel data.
+ * @param    len     Length of data in bytes.
+ *
+ * @returns  Number of pixels written, -1 on a bad format.
+ */
+int frame_write_linear(frame_t *frame, int pixel, int format, const uint8_t *data, int len)
+{
+    int size = frame_format_size(format);
+    int total = 0;
+    int chan, written;
+
+    if (!size || (pixel < 0))
+    {
+        return -1;
+    }
+
+    for (chan = 0; (chan < RPI_PWM_CHANNELS) && (len >= size); chan++)
+    {
+        if (pixel >= frame->count[chan])
+        {
+            pixel -= frame->count[chan];
+            continue;
+        }
+
+        written = frame_write(frame, chan, pixel, format, data, len);
+        if (written <= 0)
+        {
+            continue;
+        }
+
+        data += written * size;
+        len -= written * size;
+        total += written;
+        pixel = 0;
+    }
+
+    return total;
+}
+
+/**
+ * Turn every pixel of a frame off.
+ *
+ * @param    frame   Frame to clear.
+ *
+ * @returns  None
+ */
+void frame_clear(frame_t *frame)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (frame->leds[chan])
+        {
+            memset(frame->leds[chan], 0, frame->count[chan] * sizeof(ws2811_led_t));
+        }
+    }
+}
+
+/**
+ * Allocate the pixels of a frame, all off.
+ *
+ * @param    frame   Frame to set up.
+ * @param    count   Number of pixels per channel, 0 for an unused channel.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+int frame_alloc(frame_t *frame, const int *count)
+{
+    int chan;
+
+    memset(frame, 0, sizeof(*frame));
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        frame->count[chan] = count[chan];
+        if (count[chan] && !(frame->leds[chan] = calloc(count[chan], sizeof(ws2811_led_t))))
+        {
+            frame_free(frame);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free the pixels of a frame from frame_alloc().
+ *
+ * @param    frame   Frame.
+ *
+ * @returns  None
+ */
+void frame_free(frame_t *frame)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        free(frame->leds[chan]);
+        frame->leds[chan] = NULL;
+    }
+}
+
+/**
+ * Copy the pixels of one frame into another of the same size.
+ *
+ * @param    dst     Frame to write.
+ * @param    src     Frame to copy.
+ *
+ * @returns  None
+ */
+void frame_copy(frame_t *dst, const frame_t *src)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (dst->leds[chan] && src->leds[chan])
+        {
+            memcpy(dst->leds[chan], src->leds[chan], dst->count[chan] * sizeof(ws2811_led_t));
+        }
+    }
+}
+
+/**
+ * Mix two frames, for pixels between them in time.  Two bytes of a pixel
+ * are moved towards the other frame at once in 16-bit lanes, one multiply
+ * each.  A lane going down borrows from the lane above, which comes back out
+ * when the start is added again, so only the masks are needed.
+ *
+ * @param    dst     Frame to write, may be from or to.
+ * @param    from    Frame at weight 0.
+ * @param    to      Frame at weight 256.
+ * @param    weight  How far towards to, 0-256.
+ *
+ * @returns  None
+ */
+void frame_lerp(frame_t *dst, const frame_t *from, const frame_t *to, int weight)
+{
+    const uint32_t even = 0x00ff00ff;
+    const ws2811_led_t *a, *b;
+    ws2811_led_t *out;
+    uint32_t rb, wg;
+    int chan, i;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (!dst->leds[chan] || !from->leds[chan] || !to->leds[chan])
+        {
+            continue;
+        }
+
+        a = from->leds[chan];
+        b = to->leds[chan];
+        out = dst->leds[chan];
+
+        for (i = 0; i < dst->count[chan]; i++)
+        {
+            rb = (a[i] & even) + ((((b[i] & even) - (a[i] & even)) * weight) >> 8);
+            wg = ((a[i] >> 8) & even) + (((((b[i] >> 8) & even) - ((a[i] >> 8) & even)) * weight) >> 8);
+            out[i] = (rb & even) | ((wg & even) << 8);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * frame.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "ws2811.h"
+
+
+/*
+ * Ops of run-length encoded pixel data.  The top 2 bits of an op byte are
+ * the op, the low 6 bits a count of 1-64 pixels.  A long skip takes another
+ * byte, making its count 14 bits wide.  Literals are followed by count
+ * pixels, runs by the one pixel repeated count times.
+ */
+#define FRAME_OP_SKIP                            0x00     // Leave count pixels as they are
+#define FRAME_OP_LITERAL                         0x40
+#define FRAME_OP_RUN                             0x80
+#define FRAME_OP_LONG_SKIP                       0xc0     // Leave ((count << 8) | next byte) + 1 pixels
+#define FRAME_OP_MASK                            0xc0
+#define FRAME_OP_COUNT                           0x3f
+
+// Pixel buffers network data is written into, one per channel
+typedef struct
+{
+    ws2811_led_t *leds[RPI_PWM_CHANNELS];        // Pixels, NULL if the channel is unused
+    int count[RPI_PWM_CHANNELS];                 // Number of pixels
+    uint64_t present;                            // CLOCK_MONOTONIC time to show it at (nS), 0 for right away
+} frame_t;
+
+
+int frame_format_size(int format);
+int frame_write(frame_t *frame, int chan, int offset, int format, const uint8_t *data, int len);
+int frame_decode(frame_t *frame, int chan, int offset, int format, const uint8_t *data, int len);
+int frame_write_linear(frame_t *frame, int pixel, int format, const uint8_t *data, int len);
+void frame_clear(frame_t *frame);
+int frame_alloc(frame_t *frame, const int *count);
+void frame_free(frame_t *frame);
+void frame_copy(frame_t *dst, const frame_t *src);
+void frame_lerp(frame_t *dst, const frame_t *from, const frame_t *to, int weight);
+
+#endif /* __FRAME_H__ */
@@ -89,3 +89,11 @@ func Clear() {
 func SetBitmap(a []uint32) {
 	C.ws2811_set_bitmap(&C.ledstring, unsafe.Pointer(&a[0]), C.int(len(a)*4))
 }
+
+// Leds returns the LED buffer of the driver itself, writing into it avoids the
+// copy done by SetBitmap.  Go memory can't be handed to C to keep, so this is
+// the zero copy path for Go programs.
+func Leds() []uint32 {
+	count := int(C.ledstring.channel[0].count)
+	return (*[1 << 28]uint32)(unsafe.Pointer(C.ledstring.channel[0].leds))[:count:count]
+}
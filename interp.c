@@ -0,0 +1,170 @@
+/*
+ * interp.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interp.h"
+
+
+static void interp_copy(frame_t *dst, const frame_t *src)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (dst->leds[chan] && src->leds[chan])
+        {
+            memcpy(dst->leds[chan], src->leds[chan], dst->count[chan] * sizeof(ws2811_led_t));
+        }
+    }
+}
+
+/**
+ * Allocate the two frames, with no stream yet.
+ *
+ * @param    interp  Upconversion state.
+ * @param    count   Pixels per channel.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+int interp_init(interp_t *interp, const int *count)
+{
+    int chan;
+
+    memset(interp, 0, sizeof(*interp));
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        interp->from.count[chan] = count[chan];
+        interp->to.count[chan] = count[chan];
+        if (!count[chan])
+        {
+            continue;
+        }
+
+        interp->from.leds[chan] = calloc(count[chan], sizeof(ws2811_led_t));
+        interp->to.leds[chan] = calloc(count[chan], sizeof(ws2811_led_t));
+        if (!interp->from.leds[chan] || !interp->to.leds[chan])
+        {
+            interp_free(interp);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free the frames.
+ *
+ * @param    interp  Upconversion state.
+ *
+ * @returns  None
+ */
+void interp_free(interp_t *interp)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        free(interp->from.leds[chan]);
+        free(interp->to.leds[chan]);
+        interp->from.leds[chan] = NULL;
+        interp->to.leds[chan] = NULL;
+    }
+}
+
+/**
+ * Take a new frame, the newest one so far becomes the one mixed from.  The
+ * first frame of a stream is mixed from itself, so it's shown as it is.
+ *
+ * @param    interp  Upconversion state.
+ * @param    frame   New frame.
+ * @param    now     CLOCK_MONOTONIC time it came (nS).
+ *
+ * @returns  None
+ */
+void interp_push(interp_t *interp, const frame_t *frame, uint64_t now)
+{
+    uint64_t gap = now - interp->arrived;
+    frame_t swap;
+
+    if (!interp->arrived || (gap > INTERP_RESTART))
+    {
+        interp->frames = 0;
+        interp->interval = 0;
+        interp_copy(&interp->to, frame);
+    }
+    else if ((interp->frames < INTERP_FRAMES) || (gap < interp->interval * INTERP_OUTAGE))
+    {
+        // Plain mean until there are enough gaps, a moving average after that.
+        // A dropout would drag the interval out for many frames, so it's left out
+        if (interp->frames < INTERP_FRAMES)
+        {
+            interp->frames++;
+        }
+        interp->interval += ((int64_t)(gap - interp->interval)) / interp->frames;
+    }
+    interp->arrived = now;
+
+    swap = interp->from;
+    interp->from = interp->to;
+    interp->to = swap;
+    interp_copy(&interp->to, frame);
+}
+
+/**
+ * Mix the frame for a time between the two newest frames, as far from the
+ * one before towards the newest as the time is into the interval after it.
+ *
+ * @param    interp  Upconversion state, with a frame pushed.
+ * @param    frame   Frame to write.
+ * @param    now     CLOCK_MONOTONIC time to mix it for (nS).
+ *
+ * @returns  1 if later frames will differ, 0 once it's the newest frame.
+ */
+int interp_render(interp_t *interp, frame_t *frame, uint64_t now)
+{
+    uint64_t into = now - interp->arrived;
+    int weight;
+
+    if (!interp->interval || (into >= interp->interval))
+    {
+        interp_copy(frame, &interp->to);
+        return 0;
+    }
+
+    weight = (into << 8) / interp->interval;
+    frame_lerp(frame, &interp->from, &interp->to, weight);
+    interp->mixed++;
+
+    return 1;
+}
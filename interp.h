@@ -0,0 +1,63 @@
+/*
+ * interp.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __INTERP_H__
+#define __INTERP_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Frame rate upconversion.  The two newest frames are kept, and frames in
+ * between are mixed from them by how far the output is into the interval
+ * between them, which makes the output a frame interval behind the input.
+ */
+#define INTERP_FRAMES                            16       // Frames the interval is averaged over
+#define INTERP_OUTAGE                            4        // Gaps of this many intervals aren't averaged in
+#define INTERP_RESTART                           1000000000ULL  // nS without frames that restart the stream
+
+typedef struct
+{
+    frame_t from;                                // Frame before the newest
+    frame_t to;                                  // Newest frame
+    uint64_t arrived;                            // Time the newest frame came (nS), 0 for none
+    uint64_t interval;                           // Estimated time between frames (nS)
+    int frames;                                  // Gaps between frames averaged so far
+    unsigned long mixed;                         // Frames mixed between two
+} interp_t;
+
+
+int interp_init(interp_t *interp, const int *count);
+void interp_free(interp_t *interp);
+void interp_push(interp_t *interp, const frame_t *frame, uint64_t now);
+int interp_render(interp_t *interp, frame_t *frame, uint64_t now);
+
+#endif /* __INTERP_H__ */
@@ -58,6 +58,7 @@ void *mapmem(uint32_t base, uint32_t size) {
     mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, mem_fd, base & pagemask);
     if (mem == MAP_FAILED) {
         perror("mmap error\n");
+        close(mem_fd);
         return NULL;
     }
 
@@ -190,6 +191,35 @@ uint32_t mem_unlock(int file_desc, uint32_t handle) {
    return p[5];
 }
 
+/*
+ * Unlock and release a buffer in one property call, the firmware processes
+ * the tags in order.
+ */
+uint32_t mem_unlock_free(int file_desc, uint32_t handle) {
+    int i=0;
+    uint32_t p[32];
+
+    p[i++] = 0; // size
+    p[i++] = 0x00000000; // process request
+
+    p[i++] = 0x3000e; // (the tag id)
+    p[i++] = 4; // (size of the buffer)
+    p[i++] = 4; // (size of the data)
+    p[i++] = handle;
+
+    p[i++] = 0x3000f; // (the tag id)
+    p[i++] = 4; // (size of the buffer)
+    p[i++] = 4; // (size of the data)
+    p[i++] = handle;
+
+    p[i++] = 0x00000000; // end tag
+    p[0] = i * sizeof(*p); // actual size
+
+    mbox_property(file_desc, p);
+
+    return p[9];
+}
+
 uint32_t execute_code(int file_desc, uint32_t code, uint32_t r0, uint32_t r1, 
                       uint32_t r2, uint32_t r3, uint32_t r4, uint32_t r5) {
     int i=0;
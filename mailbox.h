@@ -38,6 +38,7 @@ unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags)
 unsigned mem_free(int file_desc, unsigned handle);
 unsigned mem_lock(int file_desc, unsigned handle);
 unsigned mem_unlock(int file_desc, unsigned handle);
+unsigned mem_unlock_free(int file_desc, unsigned handle);
 void *mapmem(unsigned base, unsigned size);
 void *unmapmem(void *addr, unsigned size);
 
@@ -30,6 +30,8 @@
 
 static char VERSION[] = "XX.YY.ZZ";
 
+#define _GNU_SOURCE			// recvmmsg
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,6 +49,11 @@ static char VERSION[] = "XX.YY.ZZ";
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 
 
 #include "clk.h"
@@ -54,6 +61,21 @@ static char VERSION[] = "XX.YY.ZZ";
 #include "dma.h"
 #include "pwm.h"
 #include "animations.h"
+#include "frame.h"
+#include "pixelproto.h"
+#include "e131.h"
+#include "artnet.h"
+#include "ddp.h"
+#include "opc.h"
+#include "shmframe.h"
+#include "merge.h"
+#include "timesync.h"
+#include "playout.h"
+#include "interp.h"
+#include "shard.h"
+#include "udpbatch.h"
+#include "asynclog.h"
+#include "tbuf.h"
 #include "version.h"
 
 #include "ws2811.h"
@@ -83,7 +105,29 @@ int clear_on_exit = 0;
 
 int port = PORT;
 
-#define BUFSIZE 1024
+struct in_addr multicast_group;		// Group the udp port joins, 0 if none
+int node_offset = 0;			// First pixel of this node in frames sent to the group
+
+const char *timesync_master = NULL;	// Controller whose clock timed frames are on, NULL for the system clock
+int jitter_buffer = 0;			// Show udp pixel frames at a steady cadence through the playout queue
+const char *jitter_spec = NULL;		// Its delay bounds and underrun handling
+int upconvert_fps = 0;			// Frame rate to mix frames in between received ones at, 0 for none
+
+int e131_universe = 0;			// First E1.31 universe, 0 if E1.31 is off
+int e131_universe_count = 0;		// 0 to cover all the LEDs
+int e131_shards = 0;			// E1.31 receive threads, 0 to receive on the main thread
+
+int artnet_universe = -1;		// First Art-Net port-address, -1 if Art-Net is off
+int artnet_universe_count = 0;		// 0 to cover all the LEDs
+
+int ddp_port = 0;			// DDP udp port, 0 if DDP is off
+
+int opc_port = 0;			// OPC tcp port, 0 if OPC is off
+
+const char *shm_path = NULL;		// Shared memory socket, NULL if local clients are off
+
+const char *layer_specs[MERGE_MAX_LAYERS];	// --layer options, applied once the layers exist
+int layer_spec_count = 0;
 
 
 
@@ -111,7 +155,61 @@ ws2811_t ledstring =
     },
 };
 
-ws2811_led_t *matrix;
+tbuf_t tbuf;				// Frames handed from the network thread to the render thread
+frame_t *frame;				// Where the layers are composited
+merge_t merge;				// Layer of each source, animations and network protocols write there
+timesync_t timesync;			// Clock timed frames are on
+playout_t playout;			// Timed frames waiting for their time
+unsigned long lateFrames = 0;		// Timed frames shown late, render thread side
+unsigned long farFrames = 0;		// Timed frames dropped for being too far ahead
+interp_t interp;			// Last two frames published, for upconversion
+pixelproto_t pixelproto;
+e131_t e131;
+e131_t e131Shard[SHARD_MAX];		// E1.31 state of each receive thread, a run of the universes each
+shard_set_t shards;
+artnet_t artnet;
+ddp_t ddp;
+opc_t opc;
+shmframe_t shmframe;
+
+int animfd = -1;			// timerfd ticking at the animation frame rate
+unsigned long animationPeriod = 0;	// Period animfd runs at (uS), 0 if stopped
+int layerfd = -1;			// timerfd for the next layer to time out
+uint64_t layerExpiry = 0;		// Time layerfd is set for (uS), 0 if not set
+int presentfd = -1;			// timerfd for the next timed frame
+int syncfd = -1;			// timerfd ticking the time requests
+int upfd = -1;				// timerfd ticking upconverted frames, set while they change
+int shardfd = -1;			// eventfd of the E1.31 receive threads, readable with a frame done
+int renderEventFd = -1;			// eventfd waking the render thread when a frame was published
+pthread_t mainThread, renderThread;
+
+#define MAX_EVENTS 16
+
+// Merge layers, one per source
+#define LAYER_ANIMATION		0
+#define LAYER_UDP		1
+#define LAYER_E131		2
+#define LAYER_ARTNET		3
+#define LAYER_DDP		4
+#define LAYER_OPC		5
+#define LAYER_SHM		6
+#define LAYER_TIMED		7		// Timestamped udp frames, once their time comes
+#define LAYER_COUNT		8
+
+#define STREAM_PRIORITY		100		// Network sources go over animations
+#define STREAM_TIMEOUT		2500000UL	// uS, a network source not heard from for this long drops out
+
+const char *layerNames[LAYER_COUNT] = { "animation", "udp", "e131", "artnet", "ddp", "opc", "shm", "timed" };
+
+#define PRESENT_LEAD		2000000ULL	// nS, timed frames go to the render thread this much early
+#define PRESENT_LATE		1000000ULL	// nS, timed frames shown this much after their time are late
+#define PRESENT_HORIZON		5000000000ULL	// nS, timed frames further ahead than this are dropped
+#define TIMESYNC_INTERVAL	1		// Seconds between time requests to the controller followed
+#define LED_LATCH_US		300		// uS, reset the library leaves between frames
+
+udp_batch_t batch;			// Datagrams drained from the udp port in one go, pixel frames can be large
+udp_batch_t streamBatch;		// Same for the E1.31, Art-Net and DDP sockets, whose datagrams are small
+udp_stats_t commandStats, e131Stats, artnetStats, ddpStats;
 
 volatile static uint8_t running = 1;
 
@@ -149,6 +247,17 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 		{"width", required_argument, 0, 'x'},
 		{"version", no_argument, 0, 'v'},
 		{"port", required_argument, 0, 'p'},
+		{"multicast", required_argument, 0, 'M'},
+		{"timesync", required_argument, 0, 'T'},
+		{"jitter", optional_argument, 0, 'J'},
+		{"upconvert", required_argument, 0, 'U'},
+		{"shards", required_argument, 0, 'S'},
+		{"e131", required_argument, 0, 'e'},
+		{"artnet", required_argument, 0, 'a'},
+		{"ddp", optional_argument, 0, 'D'},
+		{"opc", optional_argument, 0, 'o'},
+		{"shm", optional_argument, 0, 'm'},
+		{"layer", required_argument, 0, 'L'},
 		{0, 0, 0, 0}
 	};
 
@@ -156,7 +265,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 	{
 
 		index = 0;
-		c = getopt_long(argc, argv, "cd:g:hip:s:vx:y:", longopts, &index);
+		c = getopt_long(argc, argv, "a:cD::d:e:g:hiJ::L:M:m::o::p:S:s:T:U:vx:y:", longopts, &index);
 
 		if (c == -1)
 			break;
@@ -179,12 +288,46 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 				"                 If omitted, default is 18 (PWM0)\n"
 				"-i (--invert)  - invert pin output (pulse LOW)\n"
 				"-p (--port)    - udp port to listen on (default 9999)\n"
+				"-M (--multicast) - also receive on the udp port sent to a multicast group,\n"
+				"                 group[:offset], offset is this node's first pixel in the frames\n"
+				"-T (--timesync) - show timed frames on the clock of a controller, host[:port],\n"
+				"                 instead of the system clock.  The port defaults to --port\n"
+				"-J (--jitter)  - smooth out udp pixel frames arriving unevenly, optionally\n"
+				"                 max[,min][,repeat|interpolate] (-J250,20,interpolate), the bounds\n"
+				"                 of the delay in mS and what to do when a frame is late\n"
+				"-U (--upconvert) - show frames at this rate (fps), mixing frames in between the\n"
+				"                 ones received.  Capped at what the strip can take\n"
+				"-e (--e131)    - receive E1.31 universes, first[:count]\n"
+				"                 If count is omitted, enough to cover the LEDs\n"
+				"-S (--shards)  - receive E1.31 on this many threads, each with a run of the\n"
+				"                 universes and a socket and CPU of its own (up to 8)\n"
+				"-a (--artnet)  - receive Art-Net universes, first[:count]\n"
+				"                 first is a 15-bit port-address, count as for --e131\n"
+				"-D (--ddp)     - receive DDP, optionally on another port (-D4049, --ddp=4049)\n"
+				"                 The default DDP port is 4048\n"
+				"-o (--opc)     - accept Open Pixel Control clients, optionally on another\n"
+				"                 tcp port (-o7891, --opc=7891), the default is 7890\n"
+				"-m (--shm)     - accept local clients writing frames to shared memory,\n"
+				"                 optionally on another socket (--shm=/tmp/leds.sock)\n"
+				"                 The default socket is " SHM_FRAME_PATH "\n"
+				"-L (--layer)   - merge a source's layer differently, name=priority[,mode[,timeout]]\n"
+				"                 name is animation, udp, e131, artnet, ddp, opc, shm or timed\n"
+				"                 mode is ltp, htp or an opacity of 0-255, timeout in ms\n"
 				"-c (--clear)   - clear matrix on exit.\n"
 				"-v (--version) - version information\n"
 				, argv[0]);
 			exit(-1);
 
 		case 'D':
+			ddp_port = DDP_PORT;
+			if (optarg) {
+				ddp_port = atoi(optarg);
+				if ( ddp_port < 1 || ddp_port > 65535 )
+				{
+					fprintf (stderr, "invalid ddp port %s\n", optarg);
+					exit (-1);
+				}
+			}
 			break;
 
 		case 'g':
@@ -228,6 +371,31 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 			}
 			break;
 
+		case 'L':
+			if ( layer_spec_count == MERGE_MAX_LAYERS )
+			{
+				fprintf (stderr, "too many layers\n");
+				exit (-1);
+			}
+			layer_specs[layer_spec_count ++] = optarg;
+			break;
+
+		case 'm':
+			shm_path = optarg ? optarg : SHM_FRAME_PATH;
+			break;
+
+		case 'o':
+			opc_port = OPC_PORT;
+			if (optarg) {
+				opc_port = atoi(optarg);
+				if ( opc_port < 1 || opc_port > 65535 )
+				{
+					fprintf (stderr, "invalid opc port %s\n", optarg);
+					exit (-1);
+				}
+			}
+			break;
+
 		case 'p':
 			if (optarg) {
 				port = atoi(optarg);
@@ -239,6 +407,76 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 			}
 			break;
 
+		case 'e':
+			if (optarg) {
+				char *end;
+
+				e131_universe = strtol(optarg, &end, 10);
+				if (*end == ':')	e131_universe_count = strtol(end + 1, &end, 10);
+				if ( *end || e131_universe < 1 || e131_universe > 63999 || e131_universe_count < 0 )
+				{
+					fprintf (stderr, "invalid e1.31 universes %s\n", optarg);
+					exit (-1);
+				}
+			}
+			break;
+
+		case 'S':
+			e131_shards = atoi(optarg);
+			if ( e131_shards < 1 || e131_shards > SHARD_MAX )
+			{
+				fprintf (stderr, "invalid shard count %s\n", optarg);
+				exit (-1);
+			}
+			break;
+
+		case 'T':
+			timesync_master = optarg;
+			break;
+
+		case 'J':
+			jitter_buffer = 1;
+			jitter_spec = optarg;
+			break;
+
+		case 'U':
+			upconvert_fps = atoi(optarg);
+			if ( upconvert_fps < 1 )
+			{
+				fprintf (stderr, "invalid upconvert rate %s\n", optarg);
+				exit (-1);
+			}
+			break;
+
+		case 'M':
+			if (optarg) {
+				char group[INET_ADDRSTRLEN], *end = NULL;
+
+				snprintf(group, sizeof(group), "%.*s", (int)strcspn(optarg, ":"), optarg);
+				if (optarg[strlen(group)] == ':')	node_offset = strtol(optarg + strlen(group) + 1, &end, 10);
+				if ( ! inet_aton(group, &multicast_group) || ! IN_MULTICAST(ntohl(multicast_group.s_addr)) ||
+				     ( end && *end ) || node_offset < 0 )
+				{
+					fprintf (stderr, "invalid multicast group %s\n", optarg);
+					exit (-1);
+				}
+			}
+			break;
+
+		case 'a':
+			if (optarg) {
+				char *end;
+
+				artnet_universe = strtol(optarg, &end, 0);
+				if (*end == ':')	artnet_universe_count = strtol(end + 1, &end, 10);
+				if ( *end || artnet_universe < 0 || artnet_universe > 0x7fff || artnet_universe_count < 0 )
+				{
+					fprintf (stderr, "invalid art-net universes %s\n", optarg);
+					exit (-1);
+				}
+			}
+			break;
+
 		case 'y':
 			if (optarg) {
 				height = atoi(optarg);
@@ -312,21 +550,30 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 
 
 
-void callInitAnimationFunction(int animationId)
+// Returns 1 if the init function changed the led buffer
+
+int callInitAnimationFunction(int animationId)
 {
     // Call the init function
-    if ( animations[animationId].fps == 0 )	sleepTime = 0UL;
+    // Animations without an iterate function never change after init, they don't need ticks
+    if ( animations[animationId].fps == 0 || ! animations[animationId].iterateFunc )	sleepTime = 0UL;
     else					sleepTime = 1000000UL / (unsigned long)animations[animationId].fps;
 
-    if ( animations[animationId].initFunc )	animations[animationId].initFunc(animations[animationId].param1, animations[animationId].param2, animations[animationId].param3);
+    if ( animations[animationId].initFunc )	return animations[animationId].initFunc(animations[animationId].param1, animations[animationId].param2, animations[animationId].param3);
+
+    return 0;
 }
 
 
 
-void callIterateAnimationFunction(int animationId)
+// Returns 1 if the iterate function changed the led buffer
+
+int callIterateAnimationFunction(int animationId)
 {
 	// Call the iterate function
-	if ( animations[animationId].iterateFunc )	animations[animationId].iterateFunc(animations[animationId].param1, animations[animationId].param2, animations[animationId].param3);
+	if ( animations[animationId].iterateFunc )	return animations[animationId].iterateFunc(animations[animationId].param1, animations[animationId].param2, animations[animationId].param3);
+
+	return 0;
 }
 
 
@@ -338,7 +585,7 @@ int start_udp_server(void)
     int sockfd;
     int optval;
     struct sockaddr_in serveraddr;
-    struct timeval read_timeout;
+    struct ip_mreq mreq;
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0 );
     if ( sockfd < 0 )
@@ -356,12 +603,10 @@ int start_udp_server(void)
 	return -1;
     }
 
-    // Set a timeout of 1uS so that recvfrom becomes non blocking
-    read_timeout.tv_sec = 0;
-    read_timeout.tv_usec = 1;
-    if ( setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout)) )
+    // The socket is drained when epoll says it's readable, recvfrom must not block
+    if ( fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0 )
     {
-	perror("unable to set socket option SO_RCVTIMEO");
+	perror("unable to set socket O_NONBLOCK");
 	close(sockfd);
 	return -1;
     }
@@ -379,120 +624,550 @@ int start_udp_server(void)
 	return -1;
     }
 
+    // One datagram from a controller reaches every node in the group
+    if ( multicast_group.s_addr )
+    {
+	mreq.imr_multiaddr = multicast_group;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+	if ( setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) )
+	{
+		perror("unable to join multicast group");
+		close(sockfd);
+		return -1;
+	}
+    }
+
     return sockfd;
 }
 
 
 
-// Attempts to receive a packet on the udp socket
-// Provide socket fd, buffer and size of buffer to put received packet in
-// Return > 0 = number of bytes received
-// Return == 0 = Empty transmission or timed out
-// Return < 0 = error
+// Provide an animation name, and it returns the animation Id, returns -1 if not found
 
-int receive_udp_packet(int sockfd, char *buf, size_t bufSize)
+int animationIdByName(char *name)
 {
-	int n;
+	int i,t;
 
-	n = recvfrom(sockfd, buf, bufSize, 0, NULL, NULL);
-	if ( n < 0 && errno != EAGAIN )
+	// search for the request
+	for ( i = 0; animations[i].initFunc; i ++ )
 	{
-		perror("recvfrom");
+		for ( t = 0; animations[i].names[t]; t ++ )
+		{
+			if ( strcmp(name, animations[i].names[t]) == 0 )	return i;
+		}
+	}
+
+	return -1;
+}
+
+
+
+
+int animationRender(uint64_t present)
+{
+	int ret;
+
+	ret = present ? ws2811_render_at(&ledstring, present) : ws2811_render(&ledstring);
+        if (ret != WS2811_SUCCESS)
+        {
+		asynclog(stderr, "ws2811_render failed: %s\n", ws2811_get_return_t_str(ret));
 		return -1;
+        }
+
+	return 0;
+}
+		
+
+
+// Returns the CLOCK_MONOTONIC time in uS
+
+uint64_t nowMicros(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+
+
+// Hands the frame written to the render thread, which shows the newest frame it was handed
+// whenever it's ready for one, or at present (CLOCK_MONOTONIC nS) if that isn't 0
+
+void showFrame(uint64_t present)
+{
+	uint64_t one = 1;
+
+	frame->present = present;
+	frame = tbuf_publish(&tbuf);
+
+	if ( write(renderEventFd, &one, sizeof(one)) < 0 )	asynclog_perror("render eventfd");
+}
+
+
+
+// Starts or stops ticking upfd at the upconverted frame rate
+
+void scheduleUpconversion(int on)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	if ( on )
+	{
+		its.it_interval.tv_nsec = 1000000000L / upconvert_fps;
+		its.it_value = its.it_interval;
 	}
 
-	// This is for the situation where there was no data and we timed out, everything okay,
-	// but the data is zero length
-	if ( n < 0 )	n = 0;
+	timerfd_settime(upfd, 0, &its, NULL);
+}
+
 
-	// Terminate the string
-	buf[n] = '\0';
 
-	return n;
+// Highest frame rate the strip takes: each frame clocks 24 bits (32 for RGBW) per LED out of the
+// longer channel, then the LEDs latch
+
+int maxOutputRate(void)
+{
+	int count = ledstring.channel[0].count > ledstring.channel[1].count ? ledstring.channel[0].count : ledstring.channel[1].count;
+	int bits = ( ledstring.channel[0].strip_type & SK6812_SHIFT_WMASK ) ? 32 : 24;
+
+	return 1000000 / ( (uint64_t)count * bits * 1000000 / ledstring.freq + LED_LATCH_US );
 }
 
 
 
-// Provide an animation name, and it returns the animation Id, returns -1 if not found
+// Composites the layers and hands the result to the render thread, to show at present if that
+// isn't 0.  layerfd is set for the next layer to time out, the frame is composited again without
+// it then.  With upconversion the frames upfd ticks out get there first.
 
-int animationIdByName(char *name)
+void publishFrame(uint64_t present)
 {
-	int i,t;
+	struct itimerspec its;
+	uint64_t expiry;
 
-	// search for the request
-	for ( i = 0; animations[i].initFunc; i ++ )
+	expiry = merge_composite(&merge, frame, nowMicros());
+
+	// Upconverted frames start out at the one before and work their way to this one
+	if ( upconvert_fps && ! present )
 	{
-		for ( t = 0; animations[i].names[t]; t ++ )
+		interp_push(&interp, frame, nowMicros() * 1000ULL);
+		if ( interp_render(&interp, frame, nowMicros() * 1000ULL) )	scheduleUpconversion(1);
+	}
+
+	// An earlier timeout than layerfd is set for moves it, a later one waits for it to fire
+	if ( expiry && ( ! layerExpiry || expiry < layerExpiry ) && layerfd >= 0 )
+	{
+		layerExpiry = expiry;
+
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec  = expiry / 1000000ULL;
+		its.it_value.tv_nsec = (expiry % 1000000ULL) * 1000ULL;
+		timerfd_settime(layerfd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+	showFrame(present);
+}
+
+
+
+// Publishes a layer that was updated, bringing it back in if it had timed out
+
+void layerUpdated(int layer)
+{
+	merge_update(&merge, layer, nowMicros());
+	publishFrame(0);
+}
+
+
+
+// Sets presentfd for the earliest timed frame, PRESENT_LEAD before its time
+
+void schedulePlayout(void)
+{
+	struct itimerspec its;
+	uint64_t next = playout_next(&playout);
+
+	memset(&its, 0, sizeof(its));
+
+	if ( next )
+	{
+		next = next > PRESENT_LEAD ? next - PRESENT_LEAD : 1;
+		its.it_value.tv_sec  = next / 1000000000ULL;
+		its.it_value.tv_nsec = next % 1000000000ULL;
+	}
+
+	timerfd_settime(presentfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+
+// Takes the udp pixel frame just completed.  Timed frames wait for their time, which is on the
+// shared clock, while the clock of the controller followed isn't known yet they're shown right
+// away.  Those further ahead than PRESENT_HORIZON are dropped rather than holding up the queue.
+// With the jitter buffer the others get a time from it, otherwise they're shown now.
+
+void pixelFrameReceived(void)
+{
+	uint64_t local;
+
+	if ( pixelproto.present )
+	{
+		local = timesync_local(&timesync, pixelproto.present);
+		if ( ! local )
 		{
-			if ( strcmp(name, animations[i].names[t]) == 0 )	return i;
+			layerUpdated(LAYER_UDP);
+			return;
 		}
+
+		if ( local > nowMicros() * 1000ULL + PRESENT_HORIZON )
+		{
+			farFrames ++;
+			return;
+		}
+
+		playout_push(&playout, merge_frame(&merge, LAYER_UDP), local);
+	}
+	else if ( jitter_buffer )
+	{
+		playout_stream(&playout, merge_frame(&merge, LAYER_UDP), nowMicros() * 1000ULL);
+	}
+	else
+	{
+		layerUpdated(LAYER_UDP);
+		return;
 	}
 
-	return -1;
+	schedulePlayout();
 }
 
 
 
+// Publishes the timed frames whose time is about to come, the render thread waits for it
+
+void presentTimedFrames(void)
+{
+	uint64_t present;
+
+	while ( playout_next(&playout) && playout_next(&playout) <= nowMicros() * 1000ULL + PRESENT_LEAD )
+	{
+		present = playout_pop(&playout, merge_frame(&merge, LAYER_TIMED));
+		merge_update(&merge, LAYER_TIMED, nowMicros());
+		publishFrame(present);
+	}
+
+	schedulePlayout();
+}
 
-// Waits for a packet to be received on sockfd, or times out after timeout(uS) if one is not recevied
-// If timeout is 0, then it returns after a maximum of 1 second (depending on if a packet is recevied or not)
-// 
-// Returns -1 on error
-// Returns 0 if no data is recevied during the timeout
-// Returns 1 if data is recevied during the timeout
 
-int wait_for_packet_or_timeout(int sockfd, unsigned long timeout)
+
+// Render thread, sends the newest published frame to the LEDs until running is cleared
+// A render failure stops the server
+
+void *renderLoop(void *arg)
 {
-	int n;
-	fd_set rfds;
-	struct timeval tv;
+	frame_t *shown;
+	uint64_t events;
 
-	tv.tv_sec  = ( timeout ) ? 0	   : 1;
-	tv.tv_usec = ( timeout ) ? timeout : 0;
+	while (running)
+	{
+		if ( read(renderEventFd, &events, sizeof(events)) < 0 && errno != EINTR )
+		{
+			asynclog_perror("render eventfd");
+			break;
+		}
 
-	FD_ZERO(&rfds);
-	FD_SET(sockfd, &rfds);
+		while ( running && (shown = tbuf_acquire(&tbuf)) )
+		{
+			ws2811_set_leds(&ledstring, 0, shown->leds[0]);
 
-	n = select(sockfd+1, &rfds, NULL, NULL, &tv);
+			// Timed frames arrive a little early, they're encoded now and sent out at their time
+			if ( animationRender(shown->present) < 0 )
+			{
+				running = 0;
+				pthread_kill(mainThread, SIGTERM);
+			}
 
-	if ( n < 0 )	perror("select failed");
+			if ( shown->present && ledstring.render_error_ns > (int64_t)PRESENT_LATE )	lateFrames ++;
+		}
+	}
 
-	return n;
+	return NULL;
 }
 
 
 
-int animationRender(void)
+// Runs animfd at period(uS), on absolute deadlines starting one period from now, so the time
+// spent iterating and rendering doesn't stretch the frames.  A period of 0 stops it.
+
+void scheduleAnimation(unsigned long period)
 {
-	int i, ret;
+	struct itimerspec its;
+	struct timespec now;
+	uint64_t start;
 
-	for (i = 0; i < width; i ++ )	ledstring.channel[0].leds[i] = matrix[i];
+	if ( period == animationPeriod )	return;
+	animationPeriod = period;
 
-        if ((ret = ws2811_render(&ledstring)) != WS2811_SUCCESS)
-        {
-		fprintf(stderr, "ws2811_render failed: %s\n", ws2811_get_return_t_str(ret));
+	memset(&its, 0, sizeof(its));
+
+	if ( period )
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		start = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec + (uint64_t)period * 1000ULL;
+
+		its.it_value.tv_sec     = start / 1000000000ULL;
+		its.it_value.tv_nsec    = start % 1000000000ULL;
+		its.it_interval.tv_sec  = period / 1000000UL;
+		its.it_interval.tv_nsec = (period % 1000000UL) * 1000UL;
+	}
+
+	timerfd_settime(animfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+
+// Called after a network protocol took a packet, ready is what its receive function returned
+// Streamed frames go into the protocol's layer, which is published once a frame is complete
+
+void streamPacketReceived(int layer, int ready)
+{
+	if ( ready > 0 )	layerUpdated(layer);
+}
+
+
+
+// Handles a batch of datagrams received on the udp port
+// Only the newest animation request, or the newest pixel frame of each channel if those came
+// after it, is acted on, the rest are counted as coalesced.  Delta frames after the newest
+// keyframe are all needed, they each change the frame before them, and timed frames and those
+// going through the jitter buffer each wait for their own time.  Time requests and replies are
+// answered and taken right away.
+
+void handleCommandBatch(udp_batch_t *batch, int sockfd, int *activeAnimation)
+{
+	int32_t newestKeyframe[RPI_PWM_CHANNELS];
+	int lastRequest = -1, lastFrame = -1, valid = 0;
+	int i, chan, result, ready = -1;
+	int requestedAnimation = 0, changed;
+	const pixel_hdr_t *hdr;
+	char *name;
+
+	for ( chan = 0; chan < RPI_PWM_CHANNELS; chan ++ )	newestKeyframe[chan] = -1;
+
+	// Find the newest request and frames
+	for ( i = 0; i < batch->count; i ++ )
+	{
+		if ( batch->len[i] <= 0 )	continue;
+
+		if ( timesync_is_message(batch->buf[i], batch->len[i]) )
+		{
+			timesync_receive(&timesync, sockfd, batch->buf[i], batch->len[i], &batch->from[i]);
+			batch->len[i] = 0;
+			continue;
+		}
+		valid ++;
+
+		if ( ! pixelproto_is_frame(batch->buf[i], batch->len[i]) )
+		{
+			// Unrecognized requests don't replace the running animation
+			name = (char *)batch->buf[i];
+			if ( animationIdByName(name) < 0 )
+			{
+				asynclog(stderr, "Error: Received unrecognized animation change request: %s\n", name);
+				commandStats.dropped ++;
+				valid --;
+				continue;
+			}
+
+			requestedAnimation = animationIdByName(name);
+			lastRequest = i;
+			continue;
+		}
+
+		lastFrame = i;
+		hdr = (const pixel_hdr_t *)batch->buf[i];
+		if ( hdr->channel >= RPI_PWM_CHANNELS || jitter_buffer ||
+		     ( hdr->format & ( PIXEL_PROTO_DELTA | PIXEL_PROTO_TIMED ) ) )	continue;
+
+		if ( newestKeyframe[hdr->channel] < 0 || (int16_t)(ntohs(hdr->seq) - newestKeyframe[hdr->channel]) > 0 )
+			newestKeyframe[hdr->channel] = ntohs(hdr->seq);
+	}
+
+	if ( lastRequest > lastFrame )
+	{
+		commandStats.coalesced += valid - 1;
+
+		// Initialize the animation requested
+		*activeAnimation = requestedAnimation;
+		asynclog(stdout, "Received animation change request to: %s(%d)\n", (char *)batch->buf[lastRequest], *activeAnimation);
+
+		changed = callInitAnimationFunction(*activeAnimation);
+		scheduleAnimation(sleepTime);
+
+		// The LEDs already show (or are about to show) an unchanged buffer
+		if ( changed )	layerUpdated(LAYER_ANIMATION);
+		return;
+	}
+
+	if ( lastFrame < 0 )	return;
+
+	for ( i = 0; i < batch->count; i ++ )
+	{
+		if ( batch->len[i] <= 0 )	continue;
+
+		hdr = (const pixel_hdr_t *)batch->buf[i];
+		if ( ! pixelproto_is_frame(batch->buf[i], batch->len[i]) )
+		{
+			if ( i <= lastRequest )	commandStats.coalesced ++;
+			continue;
+		}
+
+		if ( hdr->channel < RPI_PWM_CHANNELS && newestKeyframe[hdr->channel] >= 0 &&
+		     (int16_t)(ntohs(hdr->seq) - newestKeyframe[hdr->channel]) < 0 )
+		{
+			commandStats.coalesced ++;
+			continue;
+		}
+
+		result = pixelproto_receive(&pixelproto, merge_frame(&merge, LAYER_UDP), batch->buf[i], batch->len[i]);
+		if ( result < 0 )	commandStats.dropped ++;
+
+		if ( result > 0 && ( pixelproto.present || jitter_buffer ) )
+		{
+			pixelFrameReceived();
+			continue;
+		}
+		if ( result > ready )	ready = result;
+	}
+
+	// One frame for the whole batch
+	streamPacketReceived(LAYER_UDP, ready);
+}
+
+
+
+// Adds fd to the epoll set, to wake up when it's readable
+
+int watchFd(int epfd, int fd)
+{
+	struct epoll_event event =
+	{
+		.events = EPOLLIN,
+		.data.fd = fd,
+	};
+
+	if ( epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0 )
+	{
+		asynclog_perror("epoll_ctl");
 		return -1;
-        }
+	}
 
 	return 0;
 }
-		
+
+
+
+// Reads a timerfd to rearm it, returns the number of expirations since the last read
+
+uint64_t readTimer(int fd)
+{
+	uint64_t expirations = 0;
+
+	if ( read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) )	return 0;
+
+	return expirations;
+}
+
+
+
+// Pixel format the DMX style protocols send for the strip type of channel 0
+
+int streamPixelFormat(void)
+{
+	return ( ledstring.channel[0].strip_type & SK6812_SHIFT_WMASK ) ? WS2811_PIXEL_RGBW8888 : WS2811_PIXEL_RGB888;
+}
+
+
+
+// Shard datagram handler, arg is the E1.31 state of the shard
+
+int e131ShardReceive(void *arg, frame_t *frame, const uint8_t *buf, int len, const struct sockaddr_in *from)
+{
+	return e131_receive(arg, frame, buf, len);
+}
+
+
+
+// Splits the E1.31 universes into runs, one per shard, each received on a thread of its own
+// The threads are pinned to the CPUs after the first, which the main and render threads keep
+// Returns the eventfd a frame is signalled on, -1 on error
+
+int startE131Shards(void)
+{
+	int format = streamPixelFormat();
+	int pixels = E131_SLOTS / frame_format_size(format);
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int per, first, count, i;
+	int fd;
+
+	fd = shard_init(&shards, frame->count);
+	if ( fd < 0 )	return -1;
+
+	per = ( e131_universe_count + e131_shards - 1 ) / e131_shards;
+	for ( first = 0; first < e131_universe_count; first += per )
+	{
+		count = e131_universe_count - first < per ? e131_universe_count - first : per;
+		i = shards.count;
+
+		if ( e131_open_shard(&e131Shard[i], e131_universe + first, count, format, first * pixels) < 0 ||
+		     shard_add(&shards, e131Shard[i].sockfd, e131ShardReceive, &e131Shard[i],
+			       cpus > 1 ? 1 + i % (cpus - 1) : -1) < 0 )
+		{
+			return -1;
+		}
+	}
+
+	if ( shard_start(&shards) < 0 )	return -1;
+
+	return fd;
+}
+
+
+
+// Number of universes of slots needed to cover the LEDs on both channels
+
+int universesNeeded(int slots, int format)
+{
+	int pixels_per_universe = slots / frame_format_size(format);
+
+	return (frame->count[0] + frame->count[1] + pixels_per_universe - 1) / pixels_per_universe;
+}
+
 
 
 int main(int argc, char *argv[])
 {
     int sockfd;
+    int e131fd = -1;
+    int artnetfd = -1;
+    int ddpfd = -1;
+    int opcfd = -1;
+    int shmfd = -1;
+    int epfd;
+    struct epoll_event events[MAX_EVENTS];
+    int n, i, j, fd, nevents, ready;
+    sigset_t sigs, oldsigs;
     ws2811_return_t ret;
     int activeAnimation = 1;
-    char buf[BUFSIZE + 1];
 
     sprintf(VERSION, "%d.%d.%d", VERSION_MAJOR, VERSION_MINOR, VERSION_MICRO);
 
     parseargs(argc, argv, &ledstring);
 
-    matrix = malloc(sizeof(ws2811_led_t) * width * height);
-    animSetup(matrix, width);
-
     setup_handlers();
 
     if ((ret = ws2811_init(&ledstring)) != WS2811_SUCCESS)
@@ -501,6 +1176,83 @@ int main(int argc, char *argv[])
         return ret;
     }
 
+    // Animations and network protocols write into the triple buffer, the render thread
+    // renders straight from its slots
+    if ( tbuf_init(&tbuf, (int []){ ledstring.channel[0].count, 0 }) < 0 )
+    {
+        fprintf(stderr, "unable to allocate frame buffers\n");
+        return -1;
+    }
+    frame = tbuf_writer(&tbuf);
+
+    // Every source gets a layer, the ones given on the command line are merged their way
+    merge_init(&merge, frame->count);
+    for ( i = 0; i < LAYER_COUNT; i ++ )
+    {
+	if ( merge_add(&merge, layerNames[i], i == LAYER_ANIMATION ? 0 : STREAM_PRIORITY, MERGE_LTP, 0,
+		       i == LAYER_ANIMATION ? 0 : STREAM_TIMEOUT) < 0 )
+	{
+		fprintf(stderr, "unable to allocate layers\n");
+		return -1;
+	}
+    }
+
+    for ( i = 0; i < layer_spec_count; i ++ )
+    {
+	if ( merge_configure(&merge, layer_specs[i]) < 0 )
+	{
+		fprintf(stderr, "invalid layer %s\n", layer_specs[i]);
+		return -1;
+	}
+    }
+
+    animSetup(merge_frame(&merge, LAYER_ANIMATION)->leds[0], width);
+
+    // Timed frames wait in the playout queue for their time on the clock followed
+    if ( timesync_init(&timesync, timesync_master, port) < 0 )
+    {
+	fprintf(stderr, "invalid timesync controller %s\n", timesync_master);
+	return -1;
+    }
+
+    if ( playout_init(&playout, frame->count) < 0 )
+    {
+	fprintf(stderr, "unable to allocate the playout queue\n");
+	return -1;
+    }
+
+    if ( playout_configure(&playout, jitter_spec) < 0 )
+    {
+	fprintf(stderr, "invalid jitter buffer %s\n", jitter_spec);
+	return -1;
+    }
+
+    // Frames are mixed in between those published, no faster than the strip takes them
+    if ( upconvert_fps > maxOutputRate() )
+    {
+	upconvert_fps = maxOutputRate();
+	printf("Upconverting to %d fps, the most the strip takes\n", upconvert_fps);
+    }
+
+    if ( interp_init(&interp, frame->count) < 0 )
+    {
+	fprintf(stderr, "unable to allocate upconversion frames\n");
+	return -1;
+    }
+
+    if ( udp_batch_init(&batch, UDP_BATCH_BUFSIZE) < 0 || udp_batch_init(&streamBatch, UDP_BATCH_MTU) < 0 )
+    {
+	fprintf(stderr, "unable to allocate receive buffers\n");
+	return -1;
+    }
+
+    if ( pixelproto_init(&pixelproto, frame->count) < 0 )
+    {
+	fprintf(stderr, "unable to allocate pixel frame assembly\n");
+	return -1;
+    }
+
+    pixelproto.offset = node_offset;
     sockfd = start_udp_server();
     if ( sockfd < 0 )
     {
@@ -508,6 +1260,96 @@ int main(int argc, char *argv[])
 	return sockfd;
     }
 
+    if ( e131_universe )
+    {
+	if ( ! e131_universe_count )	e131_universe_count = universesNeeded(E131_SLOTS, streamPixelFormat());
+
+	if ( e131_shards )
+	{
+		shardfd = startE131Shards();
+		if ( shardfd < 0 )
+		{
+			fprintf(stderr, "unable to start the e1.31 shards\n");
+			return -1;
+		}
+	}
+	else
+	{
+		e131fd = e131_open(&e131, e131_universe, e131_universe_count, streamPixelFormat(), frame->count);
+		if ( e131fd < 0 )
+		{
+			fprintf(stderr, "e131_open failed\n");
+			return e131fd;
+		}
+	}
+    }
+
+    if ( artnet_universe >= 0 )
+    {
+	if ( ! artnet_universe_count )	artnet_universe_count = universesNeeded(ARTNET_SLOTS, streamPixelFormat());
+
+	artnetfd = artnet_open(&artnet, artnet_universe, artnet_universe_count, streamPixelFormat(), frame->count);
+	if ( artnetfd < 0 )
+	{
+		fprintf(stderr, "artnet_open failed\n");
+		return artnetfd;
+	}
+    }
+
+    if ( ddp_port )
+    {
+	ddpfd = ddp_open(&ddp, ddp_port, streamPixelFormat(), frame->count);
+	if ( ddpfd < 0 )
+	{
+		fprintf(stderr, "ddp_open failed\n");
+		return ddpfd;
+	}
+    }
+
+    if ( opc_port )
+    {
+	opcfd = opc_open(&opc, opc_port, frame->count);
+	if ( opcfd < 0 )
+	{
+		fprintf(stderr, "opc_open failed\n");
+		return opcfd;
+	}
+    }
+
+    if ( shm_path )
+    {
+	shmfd = shmframe_open(&shmframe, shm_path, frame->count);
+	if ( shmfd < 0 )
+	{
+		fprintf(stderr, "shmframe_open failed\n");
+		return shmfd;
+	}
+    }
+
+
+    // Messages from here on are written out by a thread of their own, so a slow
+    // terminal never holds up receiving or rendering
+    asynclog_start();
+
+    // Rendering runs in a thread of its own, so the LEDs never hold up receiving
+    // Signals are left to this thread, so they interrupt epoll_wait
+    renderEventFd = eventfd(0, EFD_CLOEXEC);
+    if ( renderEventFd < 0 )
+    {
+	perror("unable to create render eventfd");
+	return -1;
+    }
+
+    mainThread = pthread_self();
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    n = pthread_create(&renderThread, NULL, renderLoop, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+    if ( n )
+    {
+	fprintf(stderr, "unable to start render thread: %s\n", strerror(n));
+	return -1;
+    }
 
     // Start the default animation, wait 2 seconds and clear
     activeAnimation = animationIdByName("startupserver");
@@ -517,49 +1359,245 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "Error: unable to find startup server animation\n");
     }
     callInitAnimationFunction(activeAnimation);
-    animationRender();
+    layerUpdated(LAYER_ANIMATION);
 
     usleep(2000000);
 
     activeAnimation = 0;
     callInitAnimationFunction(activeAnimation);
-    animationRender();
+    layerUpdated(LAYER_ANIMATION);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    animfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    layerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    presentfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    syncfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    upfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( epfd < 0 || animfd < 0 || layerfd < 0 || presentfd < 0 || syncfd < 0 || upfd < 0 )
+    {
+	perror("unable to create event loop fds");
+	return -1;
+    }
+
+    if ( watchFd(epfd, animfd) || watchFd(epfd, layerfd) || watchFd(epfd, presentfd) || watchFd(epfd, syncfd) ||
+	 watchFd(epfd, upfd) || watchFd(epfd, sockfd) ||
+	 ( e131fd >= 0 && watchFd(epfd, e131fd) ) || ( shardfd >= 0 && watchFd(epfd, shardfd) ) || ( artnetfd >= 0 && watchFd(epfd, artnetfd) ) ||
+	 ( ddpfd >= 0 && watchFd(epfd, ddpfd) ) || ( opcfd >= 0 && watchFd(epfd, opcfd) ) ||
+	 ( shmfd >= 0 && watchFd(epfd, shmfd) ) )
+    {
+	return -1;
+    }
+
+    // Count the datagrams the kernel drops when we fall behind
+    udp_batch_watch_overflows(sockfd);
+    if ( e131fd >= 0 )		udp_batch_watch_overflows(e131fd);
+    if ( artnetfd >= 0 )	udp_batch_watch_overflows(artnetfd);
+    if ( ddpfd >= 0 )		udp_batch_watch_overflows(ddpfd);
+
+    scheduleAnimation(sleepTime);
+
+    // Ask the controller followed for its time right away, then every TIMESYNC_INTERVAL
+    if ( timesync_master )
+    {
+	timerfd_settime(syncfd, 0, &(struct itimerspec){ .it_interval = { TIMESYNC_INTERVAL, 0 },
+							  .it_value = { 0, 1 } }, NULL);
+    }
 
     while (running)
     {
-	if ( receive_udp_packet(sockfd, buf, BUFSIZE) > 0 )
+	nevents = epoll_wait(epfd, events, MAX_EVENTS, -1);
+	if ( nevents < 0 )
+	{
+		if ( errno == EINTR )	continue;
+
+		asynclog_perror("epoll_wait");
+		break;
+	}
+
+	for ( i = 0; i < nevents && running; i ++ )
 	{
-		// Find the animation requested and initialize it
-		activeAnimation = animationIdByName(buf);
+		fd = events[i].data.fd;
+
+		if ( fd == animfd )
+		{
+			// Ticks missed while we were busy are dropped rather than caught up on
+			if ( ! readTimer(animfd) || ! sleepTime )	continue;
+
+			// Static frames of an animation aren't sent to the LEDs again
+			if ( callIterateAnimationFunction(activeAnimation) )	layerUpdated(LAYER_ANIMATION);
+
+			// The animation may have finished
+			scheduleAnimation(sleepTime);
+		}
+		else if ( fd == layerfd )
+		{
+			// Drop the layers that timed out, publishing sets layerfd for the next one
+			if ( ! readTimer(layerfd) )	continue;
+
+			layerExpiry = 0;
+			publishFrame(0);
+		}
+		else if ( fd == presentfd )
+		{
+			if ( ! readTimer(presentfd) )	continue;
+
+			presentTimedFrames();
+		}
+		else if ( fd == upfd )
+		{
+			if ( ! readTimer(upfd) )	continue;
 
-		if ( activeAnimation >= 0 )
+			// Once the newest frame is reached there's nothing to mix until the next one
+			if ( ! interp_render(&interp, frame, nowMicros() * 1000ULL) )	scheduleUpconversion(0);
+
+			showFrame(0);
+		}
+		else if ( fd == syncfd )
 		{
-			printf("Received animation change request to: %s(%d)\n", buf, activeAnimation);
-    			callInitAnimationFunction(activeAnimation);
+			if ( ! readTimer(syncfd) )	continue;
+
+			timesync_request(&timesync, sockfd);
 		}
-		else
+		else if ( fd == sockfd )
 		{
-			fprintf(stderr, "Error: Received unrecognized animation change request: %s\n", buf);
-			activeAnimation = 0;
+			while ( running )
+			{
+				// Frames in the LED format skip the batch buffers, their pixels land in the frame
+				n = pixelproto_receive_direct(&pixelproto, merge_frame(&merge, LAYER_UDP), sockfd, &ready);
+				if ( n > 0 )
+				{
+					commandStats.packets ++;
+					commandStats.direct ++;
+					if ( ready < 0 )	commandStats.dropped ++;
+
+					if ( ready > 0 )	pixelFrameReceived();
+					continue;
+				}
+
+				if ( n < 0 || udp_batch_receive(&batch, sockfd, &commandStats) <= 0 )	break;
+
+				handleCommandBatch(&batch, sockfd, &activeAnimation);
+			}
 		}
-	}	
+		else if ( fd == e131fd )
+		{
+			while ( running && (n = udp_batch_receive(&streamBatch, e131fd, &e131Stats)) > 0 )
+			{
+				for ( j = 0; j < n && running; j ++ )
+				{
+					if ( streamBatch.len[j] < 0 )	continue;
 
-	wait_for_packet_or_timeout(sockfd, sleepTime);
+					streamPacketReceived(LAYER_E131, e131_receive(&e131, merge_frame(&merge, LAYER_E131), streamBatch.buf[j], streamBatch.len[j]));
+				}
+			}
+		}
+		else if ( fd == shardfd )
+		{
+			// Every shard is done with its universes, or gave up waiting for the others
+			shard_take(&shards, merge_frame(&merge, LAYER_E131));
+			layerUpdated(LAYER_E131);
+		}
+		else if ( fd == artnetfd )
+		{
+			while ( running && (n = udp_batch_receive(&streamBatch, artnetfd, &artnetStats)) > 0 )
+			{
+				for ( j = 0; j < n && running; j ++ )
+				{
+					if ( streamBatch.len[j] < 0 )	continue;
 
-	if ( sleepTime)	callIterateAnimationFunction(activeAnimation);
+					streamPacketReceived(LAYER_ARTNET, artnet_receive(&artnet, merge_frame(&merge, LAYER_ARTNET), streamBatch.buf[j], streamBatch.len[j], &streamBatch.from[j]));
+				}
+			}
+		}
+		else if ( fd == ddpfd )
+		{
+			while ( running && (n = udp_batch_receive(&streamBatch, ddpfd, &ddpStats)) > 0 )
+			{
+				for ( j = 0; j < n && running; j ++ )
+				{
+					if ( streamBatch.len[j] < 0 )	continue;
 
-	if ( animationRender() < 0 )	break;
+					streamPacketReceived(LAYER_DDP, ddp_receive(&ddp, merge_frame(&merge, LAYER_DDP), streamBatch.buf[j], streamBatch.len[j]));
+				}
+			}
+		}
+		else if ( fd == opcfd )
+		{
+			// Take in everything the OPC clients sent, only the newest frame is shown
+			streamPacketReceived(LAYER_OPC, opc_poll(&opc, merge_frame(&merge, LAYER_OPC)));
+		}
+		else if ( fd == shmfd )
+		{
+			// Local clients hand over whole frames, the newest of each is taken
+			streamPacketReceived(LAYER_SHM, shmframe_poll(&shmframe, merge_frame(&merge, LAYER_SHM)));
+		}
+	}
     }
 
+    // Stop the render thread, then finish off here
+    running = 0;
+    if ( write(renderEventFd, &(uint64_t){ 1 }, sizeof(uint64_t)) < 0 )	asynclog_perror("render eventfd");
+    pthread_join(renderThread, NULL);
+
     if (clear_on_exit)
     {
-    	callInitAnimationFunction(0);
-	animationRender();
+	frame_clear(frame);
+	ws2811_set_leds(&ledstring, 0, frame->leds[0]);
+	animationRender(0);
     }
 
     ws2811_fini(&ledstring);
+    tbuf_free(&tbuf);
+    merge_free(&merge);
+    pixelproto_free(&pixelproto);
+    playout_free(&playout);
+    interp_free(&interp);
+    udp_batch_free(&batch);
+    udp_batch_free(&streamBatch);
 
     close(sockfd);
+    if ( e131fd >= 0 )	e131_close(&e131);
+    if ( shardfd >= 0 )
+    {
+	shard_stop(&shards);
+	shard_stats(&shards, &e131Stats);
+	for ( i = 0; i < shards.count; i ++ )	e131_close(&e131Shard[i]);
+    }
+    if ( artnetfd >= 0 )	artnet_close(&artnet);
+    if ( ddpfd >= 0 )	ddp_close(&ddp);
+    if ( opcfd >= 0 )	opc_close(&opc);
+    if ( shmfd >= 0 )	shmframe_close(&shmframe);
+    close(animfd);
+    close(layerfd);
+    close(presentfd);
+    close(syncfd);
+    close(upfd);
+    close(epfd);
+    close(renderEventFd);
+    asynclog_stop();
+
+    udp_batch_print_stats("udp", &commandStats);
+    printf("pixel frames: %lu complete, %lu lost, %lu fragments out of order, %lu duplicated\n",
+	   pixelproto.frames, pixelproto.lost, pixelproto.stale, pixelproto.duplicates);
+    if ( playout.queued || farFrames )
+	printf("timed frames: %lu queued, %lu dropped with the queue full, %lu too far ahead, %lu shown late\n",
+	       playout.queued, playout.dropped, farFrames, lateFrames);
+    if ( upconvert_fps )
+	printf("upconversion: %lu frames mixed at %d fps, input interval %.1f mS\n",
+	       interp.mixed, upconvert_fps, interp.interval / 1e6);
+    if ( jitter_buffer )
+	printf("jitter buffer: %lu underruns, interval %.1f mS, jitter %.1f mS, delay %.1f mS\n",
+	       playout.underruns, playout.interval / 1e6, playout.jitter / 1e6, playout.delay / 1e6);
+    if ( timesync_master )
+	printf("timesync: %lu requests, %lu replies, offset %lld nS\n",
+	       timesync.requests, timesync.replies, (long long)timesync.best);
+    if ( e131fd >= 0 || shardfd >= 0 )	udp_batch_print_stats("e1.31", &e131Stats);
+    if ( shardfd >= 0 )		printf("e1.31 shards: %lu frames, %lu with shards missing\n", shards.frames, shards.forced);
+    if ( artnetfd >= 0 )	udp_batch_print_stats("art-net", &artnetStats);
+    if ( ddpfd >= 0 )		udp_batch_print_stats("ddp", &ddpStats);
+    if ( shmfd >= 0 )		printf("shm: %lu frames\n", shmframe.frames);
+    printf("frames: %lu published, %lu superseded before they were rendered\n", tbuf.published, tbuf.superseded);
+    if ( asynclog_dropped() )	printf("log: %lu messages dropped\n", asynclog_dropped());
 
     printf ("\n");
     return ret;
@@ -0,0 +1,407 @@
+/*
+ * merge.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merge.h"
+
+
+#define MERGE_HIGH_BITS                          0x80808080
+#define MERGE_LOW_BITS                           0x7f7f7f7f
+#define MERGE_EVEN_BYTES                         0x00ff00ff
+
+
+/**
+ * Per byte maximum of two pixels.
+ *
+ * @param    a       Pixel.
+ * @param    b       Pixel.
+ *
+ * @returns  Pixel with the larger of each byte.
+ */
+static inline uint32_t merge_max(uint32_t a, uint32_t b)
+{
+    // Top bit of each byte set where the low 7 bits of a are >= those of b, the top bits
+    // keep any borrow from crossing into the next byte
+    uint32_t low = (a | MERGE_HIGH_BITS) - (b & MERGE_LOW_BITS);
+    uint32_t differ = a ^ b;
+    uint32_t ge = ((differ & a) | (~differ & low)) & MERGE_HIGH_BITS;
+    uint32_t mask = (ge >> 7) * 0xff;
+
+    return (a & mask) | (b & ~mask);
+}
+
+/**
+ * Blend a pixel over another, two bytes at a time in 16-bit lanes.
+ *
+ * @param    below   Pixel underneath.
+ * @param    above   Pixel blended over it.
+ * @param    alpha   Opacity of above, 0-256.
+ *
+ * @returns  Blended pixel.
+ */
+static inline uint32_t merge_blend(uint32_t below, uint32_t above, uint32_t alpha)
+{
+    uint32_t rb = ((above & MERGE_EVEN_BYTES) * alpha + (below & MERGE_EVEN_BYTES) * (256 - alpha)) >> 8;
+    uint32_t wg = (((above >> 8) & MERGE_EVEN_BYTES) * alpha +
+                   ((below >> 8) & MERGE_EVEN_BYTES) * (256 - alpha)) >> 8;
+
+    return (rb & MERGE_EVEN_BYTES) | ((wg & MERGE_EVEN_BYTES) << 8);
+}
+
+/**
+ * Set up an empty set of layers.
+ *
+ * @param    merge   Merge state.
+ * @param    count   Pixels per channel.
+ *
+ * @returns  0 on success.
+ */
+int merge_init(merge_t *merge, const int *count)
+{
+    int chan;
+
+    memset(merge, 0, sizeof(*merge));
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        merge->pixels[chan] = count[chan];
+    }
+
+    return 0;
+}
+
+/**
+ * Free the pixels of every layer.
+ *
+ * @param    merge   Merge state.
+ *
+ * @returns  None
+ */
+void merge_free(merge_t *merge)
+{
+    int i, chan;
+
+    for (i = 0; i < merge->count; i++)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            free(merge->layer[i].frame.leds[chan]);
+            merge->layer[i].frame.leds[chan] = NULL;
+        }
+    }
+    merge->count = 0;
+}
+
+/**
+ * Add a layer.  It stays out of the composite until it's first updated.
+ *
+ * @param    merge     Merge state.
+ * @param    name      Name merge_configure knows the layer by, not copied.
+ * @param    priority  Higher priorities are composited over lower ones.
+ * @param    mode      MERGE_LTP, MERGE_HTP or MERGE_ALPHA.
+ * @param    alpha     Opacity for MERGE_ALPHA, 0-255.
+ * @param    timeout   uS without updates before the layer drops out, 0 for never.
+ *
+ * @returns  Layer number on success, -1 if out of layers or memory.
+ */
+int merge_add(merge_t *merge, const char *name, int priority, int mode, int alpha, unsigned long timeout)
+{
+    merge_layer_t *layer;
+    int chan;
+
+    if (merge->count == MERGE_MAX_LAYERS)
+    {
+        return -1;
+    }
+
+    layer = &merge->layer[merge->count];
+    memset(layer, 0, sizeof(*layer));
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        layer->frame.count[chan] = merge->pixels[chan];
+        if (!merge->pixels[chan])
+        {
+            continue;
+        }
+
+        layer->frame.leds[chan] = calloc(merge->pixels[chan], sizeof(ws2811_led_t));
+        if (!layer->frame.leds[chan])
+        {
+            while (chan--)
+            {
+                free(layer->frame.leds[chan]);
+            }
+            return -1;
+        }
+    }
+
+    layer->name = name;
+    layer->priority = priority;
+    layer->mode = mode;
+    layer->alpha = alpha;
+    layer->timeout = timeout;
+
+    return merge->count++;
+}
+
+/**
+ * Change how a layer is merged from a "name=priority[,mode[,timeout]]"
+ * spec, where mode is ltp, htp or an opacity of 0-255 to blend the layer
+ * with, and the timeout is in milliseconds.
+ *
+ * @param    merge   Merge state.
+ * @param    spec    Layer spec.
+ *
+ * @returns  0 on success, -1 if the spec is invalid or names no layer.
+ */
+int merge_configure(merge_t *merge, const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    merge_layer_t *layer = NULL;
+    char *end;
+    long value;
+    int i;
+
+    if (!eq)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < merge->count; i++)
+    {
+        if ((strlen(merge->layer[i].name) == eq - spec) && !strncmp(merge->layer[i].name, spec, eq - spec))
+        {
+            layer = &merge->layer[i];
+        }
+    }
+
+    if (!layer)
+    {
+        return -1;
+    }
+
+    layer->priority = strtol(eq + 1, &end, 10);
+    if ((end == eq + 1) || ((*end != ',') && *end))
+    {
+        return -1;
+    }
+
+    if (!*end)
+    {
+        return 0;
+    }
+    spec = end + 1;
+
+    if (!strncmp(spec, "ltp", 3) || !strncmp(spec, "htp", 3))
+    {
+        layer->mode = (spec[0] == 'l') ? MERGE_LTP : MERGE_HTP;
+        end = (char *)spec + 3;
+    }
+    else
+    {
+        value = strtol(spec, &end, 10);
+        if ((end == spec) || (value < 0) || (value > 255))
+        {
+            return -1;
+        }
+        layer->mode = MERGE_ALPHA;
+        layer->alpha = value;
+    }
+
+    if (!*end)
+    {
+        return 0;
+    }
+    if (*end != ',')
+    {
+        return -1;
+    }
+    spec = end + 1;
+
+    value = strtol(spec, &end, 10);
+    if ((end == spec) || *end || (value < 0))
+    {
+        return -1;
+    }
+    layer->timeout = value * 1000UL;
+
+    return 0;
+}
+
+/**
+ * Pixels a layer's source writes into.
+ *
+ * @param    merge   Merge state.
+ * @param    layer   Layer number.
+ *
+ * @returns  Frame of the layer.
+ */
+frame_t *merge_frame(merge_t *merge, int layer)
+{
+    return &merge->layer[layer].frame;
+}
+
+/**
+ * Mark a layer updated, bringing it into the composite and on top of the
+ * other layers of the same priority.
+ *
+ * @param    merge   Merge state.
+ * @param    layer   Layer number.
+ * @param    now     Current time (uS).
+ *
+ * @returns  None
+ */
+void merge_update(merge_t *merge, int layer, uint64_t now)
+{
+    merge->layer[layer].active = 1;
+    merge->layer[layer].updated = now;
+    merge->layer[layer].order = ++merge->updates;
+}
+
+/**
+ * Composite the active layers into a frame.  Layers under the topmost
+ * MERGE_LTP layer can't show through it and are skipped.
+ *
+ * @param    merge   Merge state.
+ * @param    out     Frame written in full.
+ * @param    now     Current time (uS), layers past their timeout drop out.
+ *
+ * @returns  Time the next layer times out (uS), 0 if none will.
+ */
+uint64_t merge_composite(merge_t *merge, frame_t *out, uint64_t now)
+{
+    merge_layer_t *stack[MERGE_MAX_LAYERS], *layer;
+    const ws2811_led_t *pixels[MERGE_MAX_LAYERS];
+    uint32_t alpha[MERGE_MAX_LAYERS];
+    uint64_t expiry = 0;
+    ws2811_led_t *dest, pixel;
+    int i, j, n = 0, bottom = 0, chan, x;
+
+    for (i = 0; i < merge->count; i++)
+    {
+        layer = &merge->layer[i];
+        if (!layer->active)
+        {
+            continue;
+        }
+
+        if (layer->timeout)
+        {
+            if (now - layer->updated >= layer->timeout)
+            {
+                layer->active = 0;
+                continue;
+            }
+
+            if (!expiry || (layer->updated + layer->timeout < expiry))
+            {
+                expiry = layer->updated + layer->timeout;
+            }
+        }
+
+        // Insertion sort, bottom layer first
+        for (j = n; j > 0; j--)
+        {
+            if ((stack[j - 1]->priority < layer->priority) ||
+                ((stack[j - 1]->priority == layer->priority) && (stack[j - 1]->order < layer->order)))
+            {
+                break;
+            }
+            stack[j] = stack[j - 1];
+        }
+        stack[j] = layer;
+        n++;
+    }
+
+    for (i = n - 1; i >= 0; i--)
+    {
+        if (stack[i]->mode == MERGE_LTP)
+        {
+            bottom = i;
+            break;
+        }
+    }
+
+    for (i = bottom; i < n; i++)
+    {
+        alpha[i] = stack[i]->alpha + (stack[i]->alpha >> 7);
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        dest = out->leds[chan];
+        if (!dest)
+        {
+            continue;
+        }
+
+        // A single opaque layer is a straight copy
+        if ((n - bottom == 1) && (stack[bottom]->mode == MERGE_LTP))
+        {
+            memcpy(dest, stack[bottom]->frame.leds[chan], out->count[chan] * sizeof(ws2811_led_t));
+            continue;
+        }
+
+        for (i = bottom; i < n; i++)
+        {
+            pixels[i] = stack[i]->frame.leds[chan];
+        }
+
+        for (x = 0; x < out->count[chan]; x++)
+        {
+            pixel = 0;
+
+            for (i = bottom; i < n; i++)
+            {
+                switch (stack[i]->mode)
+                {
+                    case MERGE_LTP:
+                        pixel = pixels[i][x];
+                        break;
+
+                    case MERGE_HTP:
+                        pixel = merge_max(pixel, pixels[i][x]);
+                        break;
+
+                    case MERGE_ALPHA:
+                        pixel = merge_blend(pixel, pixels[i][x], alpha[i]);
+                        break;
+                }
+            }
+
+            dest[x] = pixel;
+        }
+    }
+
+    return expiry;
+}
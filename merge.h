@@ -0,0 +1,83 @@
+/*
+ * merge.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __MERGE_H__
+#define __MERGE_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Merges the frames of several sources.  Every source writes into a layer
+ * of its own, and the active layers are composited bottom to top, ordered
+ * by priority and then by when they were last updated.  A layer that
+ * wasn't updated within its timeout drops out until it is again.
+ * Compositing is one pass over the pixels, with every layer applied to a
+ * pixel before moving on to the next one, using 32-bit SWAR arithmetic on
+ * all four color bytes at once.
+ */
+#define MERGE_MAX_LAYERS                         8
+
+#define MERGE_LTP                                0        // Latest takes precedence, covers the layers below
+#define MERGE_HTP                                1        // Highest takes precedence, per color byte
+#define MERGE_ALPHA                              2        // Blended over the layers below at the layer's opacity
+
+typedef struct
+{
+    const char *name;
+    frame_t frame;                               // Pixels the source writes
+    int priority;                                // Higher priorities are composited over lower ones
+    int mode;                                    // MERGE_xxx
+    int alpha;                                   // Opacity for MERGE_ALPHA, 0-255
+    unsigned long timeout;                       // uS without updates before the layer drops out, 0 for never
+    int active;                                  // Updated and not timed out
+    uint64_t updated;                            // Time of the last update (uS)
+    unsigned long order;                         // Update number of the last update, orders equal priorities
+} merge_layer_t;
+
+typedef struct
+{
+    merge_layer_t layer[MERGE_MAX_LAYERS];
+    int count;                                   // Number of layers
+    int pixels[RPI_PWM_CHANNELS];                // Pixels per channel
+    unsigned long updates;
+} merge_t;
+
+
+int merge_init(merge_t *merge, const int *count);
+void merge_free(merge_t *merge);
+int merge_add(merge_t *merge, const char *name, int priority, int mode, int alpha, unsigned long timeout);
+int merge_configure(merge_t *merge, const char *spec);
+frame_t *merge_frame(merge_t *merge, int layer);
+void merge_update(merge_t *merge, int layer, uint64_t now);
+uint64_t merge_composite(merge_t *merge, frame_t *out, uint64_t now);
+
+#endif /* __MERGE_H__ */
@@ -0,0 +1,452 @@
+/*
+ * opc.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "opc.h"
+
+
+#define OPC_HDR_LEN                              4
+#define OPC_CMD_SET_PIXELS                       0        // RGB data
+#define OPC_PIXEL_SIZE                           3
+
+#define OPC_RING_MASK                            (OPC_RING_SIZE - 1)
+
+
+static int opc_set_nonblocking(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int opc_watch(opc_t *opc, int fd)
+{
+    struct epoll_event event =
+    {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+
+    return epoll_ctl(opc->epollfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * Open the OPC listening socket.
+ *
+ * @param    opc     OPC state.
+ * @param    port    Tcp port, normally OPC_PORT.
+ * @param    count   Pixels per channel of the frames received.
+ *
+ * @returns  Epoll fd to wait on for clients and their data on success, -1 otherwise.
+ */
+int opc_open(opc_t *opc, int port, const int *count)
+{
+    struct sockaddr_in addr;
+    int optval = 1;
+    int i;
+
+    memset(opc, 0, sizeof(*opc));
+    for (i = 0; i < OPC_MAX_CLIENTS; i++)
+    {
+        opc->clients[i].fd = -1;
+    }
+    opc->listenfd = -1;
+
+    memcpy(opc->count, count, sizeof(opc->count));
+
+    opc->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (opc->epollfd < 0)
+    {
+        perror("unable to create opc epoll fd");
+        return -1;
+    }
+
+    opc->listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (opc->listenfd < 0)
+    {
+        perror("unable to create opc socket");
+        opc_close(opc);
+        return -1;
+    }
+
+    if (setsockopt(opc->listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) ||
+        (opc_set_nonblocking(opc->listenfd) < 0))
+    {
+        perror("unable to set opc socket options");
+        opc_close(opc);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if ((bind(opc->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(opc->listenfd, OPC_MAX_CLIENTS) < 0) ||
+        (opc_watch(opc, opc->listenfd) < 0))
+    {
+        perror("unable to listen on opc socket");
+        opc_close(opc);
+        return -1;
+    }
+
+    return opc->epollfd;
+}
+
+static void opc_client_close(opc_client_t *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    frame_free(&client->staged);
+}
+
+/**
+ * Close the OPC listening socket and every client connection.
+ *
+ * @param    opc     OPC state.
+ *
+ * @returns  None
+ */
+void opc_close(opc_t *opc)
+{
+    int i;
+
+    for (i = 0; i < OPC_MAX_CLIENTS; i++)
+    {
+        if (opc->clients[i].fd >= 0)
+        {
+            opc_client_close(&opc->clients[i]);
+        }
+    }
+
+    if (opc->listenfd >= 0)
+    {
+        close(opc->listenfd);
+        opc->listenfd = -1;
+    }
+
+    if (opc->epollfd >= 0)
+    {
+        close(opc->epollfd);
+        opc->epollfd = -1;
+    }
+}
+
+/**
+ * Accept the waiting connections, turning away clients past
+ * OPC_MAX_CLIENTS.
+ *
+ * @param    opc     OPC state.
+ *
+ * @returns  None
+ */
+static void opc_accept(opc_t *opc)
+{
+    int optval = 1;
+    int fd, i;
+
+    while ((fd = accept(opc->listenfd, NULL, NULL)) >= 0)
+    {
+        for (i = 0; i < OPC_MAX_CLIENTS; i++)
+        {
+            if (opc->clients[i].fd < 0)
+            {
+                break;
+            }
+        }
+
+        if ((i == OPC_MAX_CLIENTS) || (opc_set_nonblocking(fd) < 0) || (opc_watch(opc, fd) < 0))
+        {
+            close(fd);
+            continue;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        memset(&opc->clients[i], 0, sizeof(opc->clients[i]));
+        opc->clients[i].fd = fd;
+
+        // Each client has a frame of its own, so one's messages never show half done
+        if (frame_alloc(&opc->clients[i].staged, opc->count) < 0)
+        {
+            opc_client_close(&opc->clients[i]);
+        }
+    }
+}
+
+/**
+ * Write whole pixels of the current set pixel colors message to the LED
+ * channels it addresses.
+ *
+ * @param    client  Client the pixels came from.
+ * @param    frame   Frame to write into.
+ * @param    data    RGB data.
+ * @param    pixels  Number of pixels.
+ *
+ * @returns  None
+ */
+static void opc_write(opc_client_t *client, frame_t *frame, const uint8_t *data, int pixels)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (!client->channel || (client->channel == chan + 1))
+        {
+            frame_write(frame, chan, client->pixel, WS2811_PIXEL_RGB888, data, pixels * OPC_PIXEL_SIZE);
+        }
+    }
+
+    client->pixel += pixels;
+}
+
+/**
+ * Check whether a client's ring holds another whole set pixel colors
+ * message after the one just parsed, which would replace it.
+ *
+ * @param    client  Client, between messages.
+ *
+ * @returns  1 if a later message replaces it, 0 otherwise.
+ */
+static int opc_superseded(const opc_client_t *client)
+{
+    unsigned int pos = client->tail;
+    unsigned int len;
+
+    while (client->head - pos >= OPC_HDR_LEN)
+    {
+        len = (client->ring[(pos + 2) & OPC_RING_MASK] << 8) | client->ring[(pos + 3) & OPC_RING_MASK];
+        if (client->head - pos < OPC_HDR_LEN + len)
+        {
+            break;
+        }
+
+        if (client->ring[(pos + 1) & OPC_RING_MASK] == OPC_CMD_SET_PIXELS)
+        {
+            return 1;
+        }
+        pos += OPC_HDR_LEN + len;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse what's in a client's ring buffer.  Message data is consumed in
+ * whole pixels as far as it's there, a pixel wrapping around the end of the
+ * ring is put back together first.  A set pixel colors message that
+ * completes is copied into the frame shown unless a later one is in the
+ * ring already, so the frame never gets part of the message after it and
+ * a burst of messages costs one copy.
+ *
+ * @param    client  Client.
+ * @param    frame   Frame to show.
+ *
+ * @returns  1 if a set pixel colors message completed, 0 otherwise.
+ */
+static int opc_parse(opc_client_t *client, frame_t *frame)
+{
+    uint8_t pixel[OPC_PIXEL_SIZE];
+    int complete = 0;
+    int avail, run, i;
+
+    while ((avail = client->head - client->tail) > 0)
+    {
+        if (!client->in_message)
+        {
+            if (avail < OPC_HDR_LEN)
+            {
+                break;
+            }
+
+            client->channel = client->ring[client->tail & OPC_RING_MASK];
+            client->command = client->ring[(client->tail + 1) & OPC_RING_MASK];
+            client->remaining = (client->ring[(client->tail + 2) & OPC_RING_MASK] << 8) |
+                                client->ring[(client->tail + 3) & OPC_RING_MASK];
+            client->pixel = 0;
+            client->in_message = 1;
+            client->tail += OPC_HDR_LEN;
+
+            if (!client->remaining)
+            {
+                client->in_message = 0;
+                if ((client->command == OPC_CMD_SET_PIXELS) && !opc_superseded(client))
+                {
+                    frame_copy(frame, &client->staged);
+                    complete = 1;
+                }
+            }
+            continue;
+        }
+
+        if (client->command != OPC_CMD_SET_PIXELS)
+        {
+            // System exclusive and unknown commands are skipped
+            run = (avail < client->remaining) ? avail : client->remaining;
+        }
+        else if (client->remaining < OPC_PIXEL_SIZE)
+        {
+            // Bytes of an incomplete last pixel
+            run = (avail < client->remaining) ? avail : client->remaining;
+        }
+        else
+        {
+            run = OPC_RING_SIZE - (client->tail & OPC_RING_MASK);
+            run = (run < avail) ? run : avail;
+            run = (run < client->remaining) ? run : client->remaining;
+            run -= run % OPC_PIXEL_SIZE;
+
+            if (run)
+            {
+                opc_write(client, &client->staged, &client->ring[client->tail & OPC_RING_MASK], run / OPC_PIXEL_SIZE);
+            }
+            else if (avail >= OPC_PIXEL_SIZE)
+            {
+                for (i = 0; i < OPC_PIXEL_SIZE; i++)
+                {
+                    pixel[i] = client->ring[(client->tail + i) & OPC_RING_MASK];
+                }
+                opc_write(client, &client->staged, pixel, 1);
+                run = OPC_PIXEL_SIZE;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        client->tail += run;
+        client->remaining -= run;
+
+        if (!client->remaining)
+        {
+            client->in_message = 0;
+            if ((client->command == OPC_CMD_SET_PIXELS) && !opc_superseded(client))
+            {
+                frame_copy(frame, &client->staged);
+                complete = 1;
+            }
+        }
+    }
+
+    return complete;
+}
+
+/**
+ * Read and parse everything a client sent, closing the connection when the
+ * client went away.  The ring is only parsed once it's full or the socket
+ * is drained, so messages that arrived together are parsed together.
+ *
+ * @param    client  Client.
+ * @param    frame   Frame to show.
+ * @param    data    Set when the client sent anything.
+ *
+ * @returns  1 if a set pixel colors message completed, 0 otherwise.
+ */
+static int opc_read(opc_client_t *client, frame_t *frame, int *data)
+{
+    int complete = 0, gone = 0;
+    int space, n;
+
+    while (1)
+    {
+        space = OPC_RING_SIZE - (client->head - client->tail);
+        if (!space)
+        {
+            complete |= opc_parse(client, frame);
+            continue;
+        }
+
+        if (space > OPC_RING_SIZE - (client->head & OPC_RING_MASK))
+        {
+            space = OPC_RING_SIZE - (client->head & OPC_RING_MASK);
+        }
+
+        n = recv(client->fd, &client->ring[client->head & OPC_RING_MASK], space, 0);
+        if (n <= 0)
+        {
+            gone = (n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK));
+            break;
+        }
+
+        *data = 1;
+        client->head += n;
+    }
+
+    complete |= opc_parse(client, frame);
+
+    if (gone)
+    {
+        opc_client_close(client);
+    }
+
+    return complete;
+}
+
+/**
+ * Accept new clients and take in what the connected ones sent.
+ *
+ * @param    opc     OPC state.
+ * @param    frame   Frame to write the newest complete frame into.
+ *
+ * @returns  1 if a frame completed, 0 if pixel data arrived but no frame
+ *           completed, -1 if nothing arrived.
+ */
+int opc_poll(opc_t *opc, frame_t *frame)
+{
+    int complete = 0, data = 0;
+    int i;
+
+    opc_accept(opc);
+
+    for (i = 0; i < OPC_MAX_CLIENTS; i++)
+    {
+        if (opc->clients[i].fd >= 0)
+        {
+            complete |= opc_read(&opc->clients[i], frame, &data);
+        }
+    }
+
+    if (complete)
+    {
+        return 1;
+    }
+
+    return data ? 0 : -1;
+}
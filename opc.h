@@ -0,0 +1,83 @@
+/*
+ * opc.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __OPC_H__
+#define __OPC_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Open Pixel Control server.  Clients connect over tcp and send messages
+ * of a channel, a command and a length followed by data.  Set pixel
+ * colors messages are parsed as their bytes arrive into a frame of the
+ * client's own, so a message is never held in full, and that is copied into
+ * the frame shown once a message completes that no later one received
+ * already replaces.  OPC channel 1 is LED channel 0, channel 2 LED channel
+ * 1, and channel 0 goes to both.
+ *
+ * All data waiting on the sockets is taken in at once, so when a client
+ * sends faster than the LEDs are updated only the newest frame is shown.
+ * The sockets are watched through an epoll fd of their own, which becomes
+ * readable when any of them is.
+ */
+#define OPC_PORT                                 7890
+#define OPC_MAX_CLIENTS                          8
+#define OPC_RING_SIZE                            4096     // Power of 2
+
+typedef struct
+{
+    int fd;                                      // -1 if the slot is free
+    uint8_t ring[OPC_RING_SIZE];                 // Received bytes not parsed yet
+    unsigned int head;                           // Free running write index
+    unsigned int tail;                           // Free running read index
+    int in_message;                              // Header parsed, data follows
+    uint8_t channel;                             // Header of the current message
+    uint8_t command;
+    int remaining;                               // Data bytes of the message still to come
+    int pixel;                                   // Next pixel to write
+    frame_t staged;                              // Messages being received
+} opc_client_t;
+
+typedef struct
+{
+    int epollfd;                                 // Readable when listenfd or a client is
+    int listenfd;
+    opc_client_t clients[OPC_MAX_CLIENTS];
+    int count[RPI_PWM_CHANNELS];                 // Pixels per channel of the frames received
+} opc_t;
+
+
+int opc_open(opc_t *opc, int port, const int *count);
+void opc_close(opc_t *opc);
+int opc_poll(opc_t *opc, frame_t *frame);
+
+#endif /* __OPC_H__ */
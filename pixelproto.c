@@ -0,0 +1,411 @@
+/*
+ * pixelproto.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "pixelproto.h"
+
+
+// Sequence numbers further back than this are taken as a restarted sender
+#define PIXEL_PROTO_SEQ_RESTART                  256
+
+
+/**
+ * Set up the protocol state and the frame frames are assembled in.
+ *
+ * @param    proto  Protocol state.
+ * @param    count  Pixels per channel of the frames received.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+int pixelproto_init(pixelproto_t *proto, const int *count)
+{
+    memset(proto, 0, sizeof(*proto));
+
+    return frame_alloc(&proto->staged, count);
+}
+
+/**
+ * Free the assembly frame.
+ *
+ * @param    proto  Protocol state.
+ *
+ * @returns  None
+ */
+void pixelproto_free(pixelproto_t *proto)
+{
+    frame_free(&proto->staged);
+}
+
+static int pixelproto_span_cmp(const void *a, const void *b)
+{
+    return ((const pixel_span_t *)a)->offset - ((const pixel_span_t *)b)->offset;
+}
+
+/**
+ * Bring the assembly frame of a channel up to date with the frame shown,
+ * leaving the pixels fragments of the frame being assembled were received
+ * into.
+ *
+ * @param    proto  Protocol state.
+ * @param    frame  Frame shown.
+ * @param    chan   Channel.
+ *
+ * @returns  None
+ */
+static void pixelproto_resync(pixelproto_t *proto, const frame_t *frame, int chan)
+{
+    pixel_assembly_t *assembly = &proto->assembly[chan];
+    ws2811_led_t *dst = proto->staged.leds[chan];
+    const ws2811_led_t *src = frame->leds[chan];
+    int pixel = 0, i;
+
+    qsort(assembly->span, assembly->spans, sizeof(assembly->span[0]), pixelproto_span_cmp);
+
+    for (i = 0; i < assembly->spans; i++)
+    {
+        if (assembly->span[i].offset > pixel)
+        {
+            memcpy(&dst[pixel], &src[pixel], (assembly->span[i].offset - pixel) * sizeof(ws2811_led_t));
+        }
+        if (assembly->span[i].offset + assembly->span[i].count > pixel)
+        {
+            pixel = assembly->span[i].offset + assembly->span[i].count;
+        }
+    }
+
+    if (frame->count[chan] > pixel)
+    {
+        memcpy(&dst[pixel], &src[pixel], (frame->count[chan] - pixel) * sizeof(ws2811_led_t));
+    }
+
+    assembly->stale = 0;
+}
+
+/**
+ * Check if a datagram is a pixel frame rather than an animation name.
+ *
+ * @param    buf   Datagram.
+ * @param    len   Datagram length.
+ *
+ * @returns  1 if the datagram is a pixel frame, 0 otherwise.
+ */
+int pixelproto_is_frame(const uint8_t *buf, int len)
+{
+    return (len >= sizeof(pixel_hdr_t)) && (buf[0] == PIXEL_PROTO_MAGIC);
+}
+
+/**
+ * Check a fragment's header before its pixels are written, starting the
+ * assembly of a new frame when it belongs to one.
+ *
+ * @param    proto  Protocol state.
+ * @param    hdr    Fragment header.
+ *
+ * @returns  0 if the pixels can be written, -1 on a bad or stale fragment.
+ */
+static int pixelproto_accept(pixelproto_t *proto, const pixel_hdr_t *hdr)
+{
+    pixel_assembly_t *assembly;
+    uint16_t seq = ntohs(hdr->seq);
+    int16_t age;
+
+    if ((hdr->version != PIXEL_PROTO_VERSION) || (hdr->channel >= RPI_PWM_CHANNELS) ||
+        !hdr->frag_count || (hdr->frag >= hdr->frag_count))
+    {
+        return -1;
+    }
+    assembly = &proto->assembly[hdr->channel];
+
+    // Fragments of a frame we already moved past are dropped
+    age = seq - assembly->seq;
+    if (assembly->active && (age < 0) && (age > -PIXEL_PROTO_SEQ_RESTART))
+    {
+        proto->stale++;
+        return -1;
+    }
+
+    if (!assembly->active || (seq != assembly->seq))
+    {
+        // Frames skipped over, and the one left incomplete, were lost.  The
+        // pixels of that one are left in the assembly frame, have them replaced
+        if (assembly->active)
+        {
+            proto->lost += (age > 1) ? age - 1 : 0;
+            proto->lost += assembly->received ? 1 : 0;
+            assembly->stale |= (assembly->received != 0);
+        }
+
+        assembly->active = 1;
+        assembly->seq = seq;
+        assembly->received = 0;
+        assembly->present = 0;
+        assembly->spans = 0;
+        memset(assembly->frags, 0, sizeof(assembly->frags));
+    }
+
+    // Including fragments of a frame already complete
+    if (assembly->frags[hdr->frag / 32] & (1 << (hdr->frag % 32)))
+    {
+        proto->duplicates++;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Record a fragment whose pixels were written.  A frame it completes is
+ * swapped into the frame shown.
+ *
+ * @param    proto  Protocol state.
+ * @param    frame  Frame shown.
+ * @param    hdr    Fragment header.
+ *
+ * @returns  1 if this completed a frame, 0 if more fragments are needed.
+ */
+static int pixelproto_done(pixelproto_t *proto, frame_t *frame, const pixel_hdr_t *hdr)
+{
+    pixel_assembly_t *assembly = &proto->assembly[hdr->channel];
+    ws2811_led_t *leds;
+
+    assembly->frags[hdr->frag / 32] |= 1 << (hdr->frag % 32);
+    assembly->received++;
+
+    if (assembly->received < hdr->frag_count)
+    {
+        return 0;
+    }
+
+    // Pixels the frame didn't write carry over from the one before
+    if (assembly->stale)
+    {
+        pixelproto_resync(proto, frame, hdr->channel);
+    }
+
+    // The frame shown becomes the next assembly frame, which makes it stale
+    leds = frame->leds[hdr->channel];
+    frame->leds[hdr->channel] = proto->staged.leds[hdr->channel];
+    proto->staged.leds[hdr->channel] = leds;
+    assembly->stale = 1;
+
+    // Complete, later fragments with this sequence number are duplicates
+    assembly->received = 0;
+    memset(assembly->frags, 0xff, sizeof(assembly->frags));
+    assembly->completed = 1;
+    assembly->completed_seq = assembly->seq;
+    proto->present = assembly->present;
+    proto->frames++;
+
+    return 1;
+}
+
+/**
+ * Assemble a pixel frame datagram, handing the frame over once complete.
+ *
+ * @param    proto  Protocol state.
+ * @param    frame  Frame shown, complete frames are swapped into it.
+ * @param    buf    Datagram.
+ * @param    len    Datagram length.
+ *
+ * @returns  1 if this completed a frame, 0 if more fragments are needed, -1 on a bad or stale datagram.
+ */
+int pixelproto_receive(pixelproto_t *proto, frame_t *frame, const uint8_t *buf, int len)
+{
+    const pixel_hdr_t *hdr = (const pixel_hdr_t *)buf;
+    pixel_assembly_t *assembly;
+    int format, size, written;
+    int32_t offset = ntohl(hdr->offset);
+    uint64_t present;
+
+    if (!pixelproto_is_frame(buf, len) || (offset < 0) || (pixelproto_accept(proto, hdr) < 0))
+    {
+        return -1;
+    }
+    assembly = &proto->assembly[hdr->channel];
+    format = hdr->format & ~PIXEL_PROTO_FLAGS;
+    buf += sizeof(*hdr);
+    len -= sizeof(*hdr);
+
+    if (hdr->format & PIXEL_PROTO_TIMED)
+    {
+        if (len < sizeof(uint64_t))
+        {
+            return -1;
+        }
+        // Not aligned, the Pi can't load it in one go
+        memcpy(&present, buf, sizeof(present));
+        assembly->present = be64toh(present);
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    if (hdr->format & PIXEL_PROTO_DELTA)
+    {
+        if ((len < sizeof(uint16_t)) || !assembly->completed ||
+            (((buf[0] << 8) | buf[1]) != assembly->completed_seq))
+        {
+            return -1;
+        }
+        buf += sizeof(uint16_t);
+        len -= sizeof(uint16_t);
+    }
+
+    // Pixels before the node's share of the frame are dropped
+    offset -= proto->offset;
+
+    // Skips and deltas leave pixels as they were, which needs them up to date
+    if (assembly->stale && proto->staged.leds[hdr->channel])
+    {
+        pixelproto_resync(proto, frame, hdr->channel);
+    }
+
+    if (hdr->format & PIXEL_PROTO_RLE)
+    {
+        written = frame_decode(&proto->staged, hdr->channel, offset, format, buf, len);
+    }
+    else
+    {
+        size = frame_format_size(format);
+        if ((offset < 0) && size)
+        {
+            buf += -offset * size;
+            len -= -offset * size;
+            offset = 0;
+        }
+
+        written = (len > 0) ? frame_write(&proto->staged, hdr->channel, offset, format, buf, len) : 0;
+    }
+
+    if (written < 0)
+    {
+        return -1;
+    }
+
+    return pixelproto_done(proto, frame, hdr);
+}
+
+/**
+ * Receive the next datagram on a socket if it's a pixel frame in the LED
+ * buffer's own format, scattering its pixels straight into the assembly
+ * frame.  The header is peeked first, then recvmsg puts the header in a
+ * buffer of its own and the pixels where they belong, and the complete
+ * frame is swapped in, so they are never copied.  Datagrams in any other
+ * format are left for pixelproto_receive.
+ *
+ * @param    proto   Protocol state.
+ * @param    frame   Frame shown, complete frames are swapped into it.
+ * @param    sockfd  Non-blocking udp socket.
+ * @param    ready   Set to what pixelproto_receive would have returned.
+ *
+ * @returns  1 if a datagram was received, 0 if the next datagram isn't one for this
+ *           path, -1 if none is waiting.
+ */
+int pixelproto_receive_direct(pixelproto_t *proto, frame_t *frame, int sockfd, int *ready)
+{
+    pixel_hdr_t hdr;
+    struct iovec iov[2];
+    struct msghdr msg;
+    int32_t offset;
+    int len, count = 0;
+
+    // MSG_TRUNC has the full datagram length returned
+    len = recv(sockfd, &hdr, sizeof(hdr), MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    if (len < 0)
+    {
+        return -1;
+    }
+
+    if (!pixelproto_is_frame((const uint8_t *)&hdr, len) || (hdr.format != WS2811_PIXEL_LED) ||
+        (hdr.channel >= RPI_PWM_CHANNELS) || !proto->staged.leds[hdr.channel])
+    {
+        return 0;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    // Fragments starting before the node's share of the frame take the copying path
+    offset = ntohl(hdr.offset);
+    if ((offset < 0) || (offset < proto->offset))
+    {
+        return 0;
+    }
+    offset -= proto->offset;
+    *ready = -1;
+
+    if (pixelproto_accept(proto, &hdr) == 0)
+    {
+        // Whole pixels that fit the channel, the kernel drops the rest of the datagram
+        count = (len - sizeof(hdr)) / sizeof(ws2811_led_t);
+        if (count > proto->staged.count[hdr.channel] - offset)
+        {
+            count = proto->staged.count[hdr.channel] - offset;
+        }
+
+        if (count > 0)
+        {
+            iov[1].iov_base = &proto->staged.leds[hdr.channel][offset];
+            iov[1].iov_len = count * sizeof(ws2811_led_t);
+            msg.msg_iovlen = 2;
+        }
+        *ready = 0;
+    }
+
+    if (recvmsg(sockfd, &msg, MSG_DONTWAIT) < 0)
+    {
+        *ready = -1;
+        return -1;
+    }
+
+    if (*ready == 0)
+    {
+        // Remembered so bringing the assembly frame up to date leaves them
+        if (count > 0)
+        {
+            pixel_assembly_t *assembly = &proto->assembly[hdr.channel];
+
+            assembly->span[assembly->spans].offset = offset;
+            assembly->span[assembly->spans].count = count;
+            assembly->spans++;
+        }
+
+        *ready = pixelproto_done(proto, frame, &hdr);
+    }
+
+    return 1;
+}
@@ -0,0 +1,130 @@
+/*
+ * pixelproto.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __PIXELPROTO_H__
+#define __PIXELPROTO_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Raw pixel frames sent to the udp port.  Each datagram is a header
+ * followed by pixel data for one channel.  Frames too large for one datagram
+ * are split into fragments that carry the same sequence number, each one
+ * with the pixel offset it starts at.  The frame is shown once all of its
+ * fragments arrived.
+ *
+ * Flags in the format field compress the pixel data.  With PIXEL_PROTO_RLE
+ * it's FRAME_OP_xxx ops, decoded in place.  PIXEL_PROTO_DELTA frames start
+ * with the sequence number of the frame they change, usually with ops that
+ * skip the pixels that stay the same.  They're only applied on top of that
+ * frame, so once a frame is lost the deltas are dropped until the next
+ * frame without the flag, a keyframe, brings the LEDs back in sync.
+ *
+ * PIXEL_PROTO_TIMED frames start with a 64-bit time on the shared clock
+ * (see timesync.h) to show them at, so nodes showing parts of one scene
+ * change it at the same time.  The time comes before any delta reference.
+ *
+ * When many servers share one multicast frame, each one takes the pixels
+ * from its offset on, so the same frame can drive the whole installation.
+ *
+ * Frames are assembled in a frame of the receiver's own and swapped into
+ * the frame passed in once complete, so that one only ever holds whole
+ * frames.  After a swap the assembly frame holds the frame before, and the
+ * pixels the next frame doesn't write are brought up to date from the frame
+ * passed in only when it needs them.
+ *
+ * All multi byte fields are in network byte order.
+ */
+#define PIXEL_PROTO_MAGIC                        0xa5     // Not printable, can't start an animation name
+#define PIXEL_PROTO_VERSION                      1
+
+#define PIXEL_PROTO_RLE                          0x80     // Format flag, pixel data is FRAME_OP_xxx ops
+#define PIXEL_PROTO_DELTA                        0x40     // Format flag, data starts with the frame changed
+#define PIXEL_PROTO_TIMED                        0x20     // Format flag, data starts with the time to show it
+#define PIXEL_PROTO_FLAGS                        (PIXEL_PROTO_RLE | PIXEL_PROTO_DELTA | PIXEL_PROTO_TIMED)
+
+typedef struct
+{
+    uint8_t magic;                               // PIXEL_PROTO_MAGIC
+    uint8_t version;                             // PIXEL_PROTO_VERSION
+    uint8_t channel;                             // LED channel
+    uint8_t format;                              // WS2811_PIXEL_xxx format of the pixel data and flags
+    uint16_t seq;                                // Frame sequence number
+    uint8_t frag;                                // Fragment number within the frame
+    uint8_t frag_count;                          // Number of fragments in the frame
+    uint32_t offset;                             // First pixel in this fragment
+} __attribute__((packed)) pixel_hdr_t;
+
+#define PIXEL_PROTO_MAX_FRAGS                    256
+
+// Pixels written straight into the assembly frame by one fragment
+typedef struct
+{
+    int offset;
+    int count;
+} pixel_span_t;
+
+// Fragments received so far for the frame being assembled on a channel
+typedef struct
+{
+    int active;                                  // A frame is being assembled
+    uint16_t seq;                                // Its sequence number
+    int received;                                // Number of distinct fragments received
+    uint32_t frags[PIXEL_PROTO_MAX_FRAGS / 32];  // Bitmap of the fragments received
+    int completed;                               // A frame was completed
+    uint16_t completed_seq;                      // Sequence number of the last one, deltas apply to it
+    uint64_t present;                            // Shared clock time to show the frame at, 0 if untimed
+    int stale;                                   // Assembly frame is behind the frame shown, but for the spans
+    int spans;                                   // Fragments received without copying in this frame
+    pixel_span_t span[PIXEL_PROTO_MAX_FRAGS];
+} pixel_assembly_t;
+
+typedef struct
+{
+    pixel_assembly_t assembly[RPI_PWM_CHANNELS];
+    frame_t staged;                              // Frames are assembled here
+    int offset;                                  // Pixel offset of this node's share of each frame
+    uint64_t present;                            // Time to show the frame completed last at, 0 if untimed
+    unsigned long frames;                        // Frames completed
+    unsigned long lost;                          // Frames skipped over or left incomplete
+    unsigned long stale;                         // Fragments of older frames, out of order
+    unsigned long duplicates;                    // Fragments received again
+} pixelproto_t;
+
+
+int pixelproto_init(pixelproto_t *proto, const int *count);
+void pixelproto_free(pixelproto_t *proto);
+int pixelproto_is_frame(const uint8_t *buf, int len);
+int pixelproto_receive(pixelproto_t *proto, frame_t *frame, const uint8_t *buf, int len);
+int pixelproto_receive_direct(pixelproto_t *proto, frame_t *frame, int sockfd, int *ready);
+
+#endif /* __PIXELPROTO_H__ */
@@ -0,0 +1,324 @@
+/*
+ * playout.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "playout.h"
+
+
+#define MIN(a, b)                                ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                                ((a) > (b) ? (a) : (b))
+
+
+static void playout_copy(frame_t *dst, const frame_t *src)
+{
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (dst->leds[chan] && src->leds[chan])
+        {
+            memcpy(dst->leds[chan], src->leds[chan], dst->count[chan] * sizeof(ws2811_led_t));
+        }
+    }
+}
+
+/**
+ * Allocate the frames of an empty queue.
+ *
+ * @param    playout  Playout queue.
+ * @param    count    Pixels per channel.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+int playout_init(playout_t *playout, const int *count)
+{
+    int i, chan;
+
+    memset(playout, 0, sizeof(*playout));
+    playout->min_delay = PLAYOUT_MIN_DELAY * 1000000ULL;
+    playout->max_delay = PLAYOUT_MAX_DELAY * 1000000ULL;
+
+    for (i = 0; i < PLAYOUT_SLOTS; i++)
+    {
+        playout->order[i] = i;
+
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            playout->slot[i].count[chan] = count[chan];
+            if (!count[chan])
+            {
+                continue;
+            }
+
+            playout->slot[i].leds[chan] = calloc(count[chan], sizeof(ws2811_led_t));
+            if (!playout->slot[i].leds[chan])
+            {
+                playout_free(playout);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free the frames of the queue.
+ *
+ * @param    playout  Playout queue.
+ *
+ * @returns  None
+ */
+void playout_free(playout_t *playout)
+{
+    int i, chan;
+
+    for (i = 0; i < PLAYOUT_SLOTS; i++)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            free(playout->slot[i].leds[chan]);
+            playout->slot[i].leds[chan] = NULL;
+        }
+    }
+    playout->count = 0;
+}
+
+/**
+ * Queue a copy of a frame.
+ *
+ * @param    playout  Playout queue.
+ * @param    frame    Frame to copy.
+ * @param    present  CLOCK_MONOTONIC time to show it at (nS).
+ *
+ * @returns  Slot it went into.
+ */
+static int playout_insert(playout_t *playout, const frame_t *frame, uint64_t present)
+{
+    int slot, i;
+
+    if (playout->count == PLAYOUT_SLOTS)
+    {
+        playout_pop(playout, NULL);
+        playout->dropped++;
+    }
+
+    slot = playout->order[playout->count];
+    playout_copy(&playout->slot[slot], frame);
+    playout->slot[slot].present = present;
+    playout->ease[slot] = 0;
+
+    // Frames mostly arrive in order, so this rarely moves anything
+    for (i = playout->count; i > 0; i--)
+    {
+        if (playout->slot[playout->order[i - 1]].present <= present)
+        {
+            break;
+        }
+        playout->order[i] = playout->order[i - 1];
+    }
+    playout->order[i] = slot;
+
+    playout->count++;
+    playout->queued++;
+
+    return slot;
+}
+
+/**
+ * Queue a copy of a frame.
+ *
+ * @param    playout  Playout queue.
+ * @param    frame    Frame to copy.
+ * @param    present  CLOCK_MONOTONIC time to show it at (nS).
+ *
+ * @returns  None
+ */
+void playout_push(playout_t *playout, const frame_t *frame, uint64_t present)
+{
+    playout_insert(playout, frame, present);
+}
+
+/**
+ * Time of the earliest frame queued.
+ *
+ * @param    playout  Playout queue.
+ *
+ * @returns  CLOCK_MONOTONIC time (nS), 0 if the queue is empty.
+ */
+uint64_t playout_next(playout_t *playout)
+{
+    return playout->count ? playout->slot[playout->order[0]].present : 0;
+}
+
+/**
+ * Take the earliest frame off the queue.  A frame resuming the stream after
+ * an underrun is, when interpolating, first mixed halfway into the frame
+ * shown before it and left queued half an interval later.
+ *
+ * @param    playout  Playout queue, not empty.
+ * @param    frame    Frame to copy it into, holding the frame shown last, NULL to drop it.
+ *
+ * @returns  Its CLOCK_MONOTONIC time (nS).
+ */
+uint64_t playout_pop(playout_t *playout, frame_t *frame)
+{
+    int slot = playout->order[0];
+    uint64_t present = playout->slot[slot].present;
+
+    if (frame && playout->ease[slot] && (playout->mode == PLAYOUT_INTERPOLATE))
+    {
+        frame_lerp(frame, frame, &playout->slot[slot], 128);
+        playout->slot[slot].present += playout->interval / 2;
+        playout->ease[slot] = 0;
+
+        return present;
+    }
+
+    if (frame)
+    {
+        playout_copy(frame, &playout->slot[slot]);
+    }
+
+    playout->count--;
+    memmove(&playout->order[0], &playout->order[1], playout->count * sizeof(int));
+    playout->order[playout->count] = slot;
+
+    return playout->slot[slot].present;
+}
+
+/**
+ * Set up the jitter buffer from a "max[,min][,repeat|interpolate]" spec,
+ * the delays in milliseconds.  Parts left out keep their defaults.
+ *
+ * @param    playout  Playout queue.
+ * @param    spec     Jitter buffer spec, NULL or empty for the defaults.
+ *
+ * @returns  0 on success, -1 if the spec is invalid.
+ */
+int playout_configure(playout_t *playout, const char *spec)
+{
+    uint64_t *bound = &playout->max_delay;
+    char *end;
+    long value;
+
+    while (spec && *spec)
+    {
+        if (!strncmp(spec, "repeat", 6) || !strncmp(spec, "interpolate", 11))
+        {
+            playout->mode = (spec[0] == 'r') ? PLAYOUT_REPEAT : PLAYOUT_INTERPOLATE;
+            end = (char *)spec + ((spec[0] == 'r') ? 6 : 11);
+        }
+        else
+        {
+            value = strtol(spec, &end, 10);
+            if ((end == spec) || (value < 0) || (value > 10000) || !bound)
+            {
+                return -1;
+            }
+            *bound = value * 1000000ULL;
+            bound = (bound == &playout->max_delay) ? &playout->min_delay : NULL;
+        }
+
+        if (*end && (*end != ','))
+        {
+            return -1;
+        }
+        spec = *end ? end + 1 : end;
+    }
+
+    return (playout->min_delay <= playout->max_delay) ? 0 : -1;
+}
+
+/**
+ * Queue a streamed frame, giving it a time.  Frames are shown one interval
+ * after the one before, drifting slowly towards their arrival plus the delay.
+ * A frame arriving after its turn restarts the cadence from its arrival.
+ *
+ * @param    playout  Playout queue.
+ * @param    frame    Frame to copy.
+ * @param    now      CLOCK_MONOTONIC time it arrived at (nS).
+ *
+ * @returns  None
+ */
+void playout_stream(playout_t *playout, const frame_t *frame, uint64_t now)
+{
+    uint64_t gap = now - playout->arrived;
+    uint64_t target, present;
+    int64_t deviation;
+    int late = 0;
+
+    if (!playout->arrived || (gap > PLAYOUT_RESTART))
+    {
+        // First frame of a stream, nothing to go by yet
+        playout->interval = 0;
+        playout->jitter = 0;
+        playout->scheduled = 0;
+        playout->streamed = 0;
+    }
+    else if ((playout->streamed < PLAYOUT_JITTER_FRAMES) || (gap < playout->interval * PLAYOUT_OUTAGE))
+    {
+        // Plain means until there are enough frames, moving averages after that
+        playout->streamed++;
+        deviation = (int64_t)(gap - playout->interval);
+        playout->interval += deviation / MIN(playout->streamed, PLAYOUT_SMOOTH_FRAMES);
+
+        if (playout->streamed > 1)
+        {
+            deviation = (int64_t)(gap - playout->interval);
+            deviation = (deviation < 0) ? -deviation : deviation;
+            playout->jitter += (deviation - (int64_t)playout->jitter) / MIN(playout->streamed - 1, PLAYOUT_JITTER_FRAMES);
+        }
+    }
+    playout->arrived = now;
+
+    playout->delay = playout->jitter * PLAYOUT_JITTER_FACTOR;
+    playout->delay = MAX(playout->delay, playout->min_delay);
+    playout->delay = MIN(playout->delay, playout->max_delay);
+    target = now + playout->delay;
+
+    if (playout->scheduled && (playout->scheduled + playout->interval > now))
+    {
+        present = playout->scheduled + playout->interval;
+        present += (int64_t)(target - present) / PLAYOUT_SMOOTH_FRAMES;
+        present = MIN(present, now + playout->max_delay);
+    }
+    else
+    {
+        late = (playout->scheduled != 0);
+        playout->underruns += late;
+        present = target;
+    }
+
+    playout->ease[playout_insert(playout, frame, present)] = late;
+    playout->scheduled = present;
+}
@@ -0,0 +1,93 @@
+/*
+ * playout.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __PLAYOUT_H__
+#define __PLAYOUT_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Queue of frames waiting for their presentation time, kept in time order.
+ * When it's full the earliest frame makes room for the new one.
+ */
+#define PLAYOUT_SLOTS                            16
+
+/*
+ * Streamed frames without a time of their own can be given one by the jitter
+ * buffer.  It estimates the frame interval and how much arrivals stray from
+ * it, and shows the frames at the interval, delayed by a few times the
+ * jitter within the configured bounds.  When a frame comes too late for its
+ * turn the last one stays up, or with PLAYOUT_INTERPOLATE the late frame is
+ * eased in through one halfway between the two.
+ */
+#define PLAYOUT_REPEAT                           0
+#define PLAYOUT_INTERPOLATE                      1
+
+#define PLAYOUT_MIN_DELAY                        20       // Default bounds of the delay (mS)
+#define PLAYOUT_MAX_DELAY                        250
+#define PLAYOUT_JITTER_FACTOR                    3        // Delay in jitters
+#define PLAYOUT_JITTER_FRAMES                    16       // Frames the jitter is averaged over
+#define PLAYOUT_SMOOTH_FRAMES                    64       // Frames the interval is averaged over
+#define PLAYOUT_OUTAGE                           4        // Gaps of this many intervals aren't averaged in
+#define PLAYOUT_RESTART                          1000000000ULL  // nS without frames that restart the stream
+
+typedef struct
+{
+    frame_t slot[PLAYOUT_SLOTS];                 // Frames, present holds their time
+    uint8_t ease[PLAYOUT_SLOTS];                 // Slot resumes the stream after an underrun
+    int order[PLAYOUT_SLOTS];                    // Slots queued earliest first, then the free ones
+    int count;                                   // Frames queued
+    unsigned long queued;                        // Frames pushed
+    unsigned long dropped;                       // Frames pushed out by later ones
+
+    int mode;                                    // PLAYOUT_REPEAT or PLAYOUT_INTERPOLATE
+    uint64_t min_delay;                          // Bounds of the delay (nS)
+    uint64_t max_delay;
+    uint64_t interval;                           // Estimated time between frames (nS)
+    uint64_t jitter;                             // Mean deviation of arrivals from the interval (nS)
+    uint64_t delay;                              // Delay frames are shown with (nS)
+    uint64_t arrived;                            // Arrival of the last frame streamed, 0 for none
+    int streamed;                                // Gaps between frames since the stream started
+    uint64_t scheduled;                          // Time it was given
+    unsigned long underruns;                     // Frames that came too late for their turn
+} playout_t;
+
+
+int playout_init(playout_t *playout, const int *count);
+void playout_free(playout_t *playout);
+void playout_push(playout_t *playout, const frame_t *frame, uint64_t present);
+uint64_t playout_next(playout_t *playout);
+uint64_t playout_pop(playout_t *playout, frame_t *frame);
+int playout_configure(playout_t *playout, const char *spec);
+void playout_stream(playout_t *playout, const frame_t *frame, uint64_t now);
+
+#endif /* __PLAYOUT_H__ */
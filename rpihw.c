@@ -33,12 +33,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "rpihw.h"
 
 
 #define LINE_WIDTH_MAX                           80
 #define HW_VER_STRING                            "Revision"
+#define DT_REVISION_PATH                         "/proc/device-tree/system/linux,revision"
 
 #define PERIPH_BASE_RPI                          0x20000000
 #define PERIPH_BASE_RPI2                         0x3f000000
@@ -49,6 +52,14 @@
 #define RPI_MANUFACTURER_MASK                    (0xf << 16)
 #define RPI_WARRANTY_MASK                        (0x3 << 24)
 
+// New style revision code fields
+#define RPI_REV_NEW_STYLE                        (1 << 23)
+#define RPI_REV_TYPE(rev)                        (((rev) >> 4) & 0xff)
+#define RPI_REV_PROCESSOR(rev)                   (((rev) >> 12) & 0xf)
+#define RPI_REV_PROCESSOR_BCM2835                0
+#define RPI_REV_PROCESSOR_BCM2836                1
+#define RPI_REV_PROCESSOR_BCM2837                2
+
 static const rpi_hw_t rpi_hw_info[] = {
     //
     // Model B Rev 1.0
@@ -160,13 +171,6 @@ static const rpi_hw_t rpi_hw_info[] = {
         .videocore_base = VIDEOCORE_BASE_RPI,
         .desc = "Model B+",
     },
-    {
-        .hwver  = 0x900032,
-        .type = RPI_HWVER_TYPE_PI1,
-        .periph_base = PERIPH_BASE_RPI,
-        .videocore_base = VIDEOCORE_BASE_RPI,
-        .desc = "Model B+",
-    },
 
     //
     // Compute Module
@@ -186,45 +190,6 @@ static const rpi_hw_t rpi_hw_info[] = {
         .desc = "Compute Module",
     },
 
-    //
-    // Pi Zero
-    //
-    {
-        .hwver  = 0x900092,
-        .type = RPI_HWVER_TYPE_PI1,
-        .periph_base = PERIPH_BASE_RPI,
-        .videocore_base = VIDEOCORE_BASE_RPI,
-        .desc = "Pi Zero v1.2",
-    },
-    {
-        .hwver  = 0x900093,
-        .type = RPI_HWVER_TYPE_PI1,
-        .periph_base = PERIPH_BASE_RPI,
-        .videocore_base = VIDEOCORE_BASE_RPI,
-        .desc = "Pi Zero v1.3",
-    },
-    {
-        .hwver  = 0x920093,
-        .type = RPI_HWVER_TYPE_PI1,
-        .periph_base = PERIPH_BASE_RPI,
-        .videocore_base = VIDEOCORE_BASE_RPI,
-        .desc = "Pi Zero v1.3",
-    },
-    {
-        .hwver  = 0x9200c1,
-        .type = RPI_HWVER_TYPE_PI1,
-        .periph_base = PERIPH_BASE_RPI,
-        .videocore_base = VIDEOCORE_BASE_RPI,
-        .desc = "Pi Zero W",
-    },
-    {
-        .hwver  = 0x9000c1,
-        .type = RPI_HWVER_TYPE_PI1,
-        .periph_base = PERIPH_BASE_RPI,
-        .videocore_base = VIDEOCORE_BASE_RPI,
-        .desc = "Pi Zero W v1.1",
-    },
-
     //
     // Model A+
     //
@@ -242,90 +207,80 @@ static const rpi_hw_t rpi_hw_info[] = {
         .videocore_base = VIDEOCORE_BASE_RPI,
         .desc = "Model A+",
     },
+};
 
-    //
-    // Pi 2 Model B
-    //
-    {
-        .hwver  = 0xa01041,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 2",
-    },
-    {
-        .hwver  = 0xa01040,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 2",
-    },
-    {
-        .hwver  = 0xa21041,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 2",
-    },
-    //
-    // Pi 2 with BCM2837
-    //
-    {
-        .hwver  = 0xa22042,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 2",
-    },
-    //
-    // Pi 3 Model B
-    //
-    {
-        .hwver  = 0xa02082,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 3",
-    },
+// Board names indexed by the type field of a new style revision code
+static const char *rpi_type_desc[] = {
+    [0x00] = "Model A",
+    [0x01] = "Model B",
+    [0x02] = "Model A+",
+    [0x03] = "Model B+",
+    [0x04] = "Pi 2",
+    [0x05] = "Alpha",
+    [0x06] = "Compute Module",
+    [0x08] = "Pi 3",
+    [0x09] = "Pi Zero",
+    [0x0a] = "Compute Module 3",
+    [0x0c] = "Pi Zero W",
+    [0x0d] = "Pi 3 Model B+",
+    [0x0e] = "Pi 3 Model A+",
+    [0x10] = "Compute Module 3+",
+};
+
+// Filled in by the first successful rpi_hw_detect(), the board can't change under us
+static rpi_hw_t rpi_hw_decoded;
+static const rpi_hw_t *rpi_hw_cached;
+
+
+/*
+ * Read the board revision code the firmware put in the device tree.  This is
+ * a single 4 byte big endian cell, so no parsing is needed.
+ */
+static int rpi_hw_revision_dt(uint32_t *rev)
+{
+    uint8_t cell[4];
+    ssize_t len;
+    int fd;
+
+    fd = open(DT_REVISION_PATH, O_RDONLY);
+    if (fd < 0)
     {
-        .hwver  = 0xa22082,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 3",
-    },
-    //
-    // Pi Compute Module 3
-    //
+        return -1;
+    }
+
+    len = read(fd, cell, sizeof(cell));
+    close(fd);
+
+    if (len != sizeof(cell))
     {
-        .hwver  = 0xa020a0,
-        .type = RPI_HWVER_TYPE_PI2,
-        .periph_base = PERIPH_BASE_RPI2,
-        .videocore_base = VIDEOCORE_BASE_RPI2,
-        .desc = "Pi 3",
-    },
+        return -1;
+    }
 
-};
+    *rev = (cell[0] << 24) | (cell[1] << 16) | (cell[2] << 8) | cell[3];
 
+    return 0;
+}
 
-const rpi_hw_t *rpi_hw_detect(void)
+/*
+ * Older kernels don't export the revision in the device tree, fall back to
+ * scanning /proc/cpuinfo for it.
+ */
+static int rpi_hw_revision_cpuinfo(uint32_t *rev)
 {
     FILE *f = fopen("/proc/cpuinfo", "r");
     char line[LINE_WIDTH_MAX];
-    const rpi_hw_t *result = NULL;
+    int result = -1;
 
     if (!f)
     {
-        return NULL;
+        return -1;
     }
 
     while (fgets(line, LINE_WIDTH_MAX - 1, f))
     {
         if (strstr(line, HW_VER_STRING))
         {
-            uint32_t rev;
             char *substr;
-            unsigned i;
 
             substr = strstr(line, ": ");
             if (!substr)
@@ -334,33 +289,97 @@ const rpi_hw_t *rpi_hw_detect(void)
             }
 
             errno = 0;
-            rev = strtoul(&substr[1], NULL, 16);  // Base 16
+            *rev = strtoul(&substr[1], NULL, 16);  // Base 16
             if (errno)
             {
                 continue;
             }
 
-            for (i = 0; i < (sizeof(rpi_hw_info) / sizeof(rpi_hw_info[0])); i++)
-            {
-                uint32_t hwver = rpi_hw_info[i].hwver;
-
-                // Take out warranty and manufacturer bits
-                hwver &= ~(RPI_WARRANTY_MASK | RPI_MANUFACTURER_MASK);
-                rev &= ~(RPI_WARRANTY_MASK | RPI_MANUFACTURER_MASK);
-                
-                if (rev == hwver)
-                {
-                    result = &rpi_hw_info[i];
-
-                    goto done;
-                }
-            }
+            result = 0;
+            break;
         }
     }
 
-done:
     fclose(f);
 
     return result;
 }
 
+/*
+ * New style revision codes describe the board in bit fields, so the
+ * processor (and with it the peripheral layout) can be read out directly.
+ */
+static const rpi_hw_t *rpi_hw_decode(uint32_t rev)
+{
+    rpi_hw_t *hw = &rpi_hw_decoded;
+    uint32_t type = RPI_REV_TYPE(rev);
+
+    switch (RPI_REV_PROCESSOR(rev))
+    {
+        case RPI_REV_PROCESSOR_BCM2835:
+            hw->type = RPI_HWVER_TYPE_PI1;
+            hw->periph_base = PERIPH_BASE_RPI;
+            hw->videocore_base = VIDEOCORE_BASE_RPI;
+            break;
+
+        case RPI_REV_PROCESSOR_BCM2836:
+        case RPI_REV_PROCESSOR_BCM2837:
+            hw->type = RPI_HWVER_TYPE_PI2;
+            hw->periph_base = PERIPH_BASE_RPI2;
+            hw->videocore_base = VIDEOCORE_BASE_RPI2;
+            break;
+
+        default:
+            return NULL;
+    }
+
+    hw->hwver = rev;
+    hw->desc = "Unknown";
+    if ((type < (sizeof(rpi_type_desc) / sizeof(rpi_type_desc[0]))) && rpi_type_desc[type])
+    {
+        hw->desc = (char *)rpi_type_desc[type];
+    }
+
+    return hw;
+}
+
+const rpi_hw_t *rpi_hw_detect(void)
+{
+    uint32_t rev;
+    unsigned i;
+
+    if (rpi_hw_cached)
+    {
+        return rpi_hw_cached;
+    }
+
+    if (rpi_hw_revision_dt(&rev) && rpi_hw_revision_cpuinfo(&rev))
+    {
+        return NULL;
+    }
+
+    // Take out warranty bits, they say nothing about the hardware
+    rev &= ~RPI_WARRANTY_MASK;
+
+    if (rev & RPI_REV_NEW_STYLE)
+    {
+        rpi_hw_cached = rpi_hw_decode(rev);
+
+        return rpi_hw_cached;
+    }
+
+    // Old style revision codes are plain numbers, take out manufacturer bits too
+    rev &= ~RPI_MANUFACTURER_MASK;
+
+    for (i = 0; i < (sizeof(rpi_hw_info) / sizeof(rpi_hw_info[0])); i++)
+    {
+        if (rev == rpi_hw_info[i].hwver)
+        {
+            rpi_hw_cached = &rpi_hw_info[i];
+            break;
+        }
+    }
+
+    return rpi_hw_cached;
+}
+
@@ -44,7 +44,7 @@ typedef struct {
 } rpi_hw_t;
 
 
-const rpi_hw_t *rpi_hw_detect(void);
+const rpi_hw_t *rpi_hw_detect(void);                  // Result is cached after the first call
 
 
 #endif /* __RPIHW_H__ */
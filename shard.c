@@ -0,0 +1,420 @@
+/*
+ * shard.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE                              // pthread_setaffinity_np, recvmmsg
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "shard.h"
+#include "asynclog.h"
+
+
+/**
+ * Hand the frame to the main thread.  Called with the lock held.
+ *
+ * @param    set     Shard set.
+ *
+ * @returns  None
+ */
+static void shard_hold(shard_set_t *set)
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&set->held, 1, __ATOMIC_RELEASE);
+    if (write(set->eventfd, &one, sizeof(one)) < 0)
+    {
+        asynclog_perror("shard eventfd");
+    }
+}
+
+/**
+ * Wait while a frame is held, so nothing is written into it while the main
+ * thread copies it.
+ *
+ * @param    set     Shard set.
+ *
+ * @returns  None
+ */
+static void shard_wait_held(shard_set_t *set)
+{
+    if (!__atomic_load_n(&set->held, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    while (set->held && set->running)
+    {
+        pthread_cond_wait(&set->released, &set->lock);
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Wait at the barrier with the shard's part of the frame done, until the
+ * frame was taken.  The last shard to arrive holds the frame, and so does
+ * the first one to give up on the others, which aren't waited for then.
+ *
+ * @param    shard   Shard arriving.
+ *
+ * @returns  None
+ */
+static void shard_arrive(shard_t *shard)
+{
+    shard_set_t *set = shard->set;
+    unsigned long generation;
+    struct timespec deadline;
+    uint64_t ns;
+    int i;
+
+    pthread_mutex_lock(&set->lock);
+
+    if (shard->idle)
+    {
+        shard->idle = 0;
+        set->idle--;
+    }
+
+    generation = set->generation;
+    shard->arrived = 1;
+    if ((++set->arrived >= set->count - set->idle) && !set->held)
+    {
+        set->frames++;
+        shard_hold(set);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    ns = (uint64_t)deadline.tv_sec * 1000000000ULL + deadline.tv_nsec + SHARD_TIMEOUT;
+    deadline.tv_sec = ns / 1000000000ULL;
+    deadline.tv_nsec = ns % 1000000000ULL;
+
+    while ((set->generation == generation) && set->running)
+    {
+        // Once the frame is held there's nothing to give up on, and the
+        // deadline may have passed already
+        if (set->held)
+        {
+            pthread_cond_wait(&set->released, &set->lock);
+        }
+        else if ((pthread_cond_timedwait(&set->released, &set->lock, &deadline) == ETIMEDOUT) &&
+                 !set->held && (set->generation == generation))
+        {
+            for (i = 0; i < set->count; i++)
+            {
+                if (!set->shard[i].arrived && !set->shard[i].idle)
+                {
+                    set->shard[i].idle = 1;
+                    set->idle++;
+                }
+            }
+
+            set->forced++;
+            shard_hold(set);
+        }
+    }
+
+    pthread_mutex_unlock(&set->lock);
+}
+
+static void *shard_loop(void *arg)
+{
+    shard_t *shard = arg;
+    shard_set_t *set = shard->set;
+    struct pollfd pfd = { .fd = shard->sockfd, .events = POLLIN };
+    cpu_set_t cpus;
+    int n, i;
+
+    if (shard->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    while (set->running)
+    {
+        if (poll(&pfd, 1, SHARD_POLL_MS) <= 0)
+        {
+            continue;
+        }
+
+        while (set->running && ((n = udp_batch_receive(shard->batch, shard->sockfd, &shard->stats)) > 0))
+        {
+            for (i = 0; (i < n) && set->running; i++)
+            {
+                if (shard->batch->len[i] < 0)
+                {
+                    continue;
+                }
+
+                shard_wait_held(set);
+
+                switch (shard->receive(shard->arg, &set->frame, shard->batch->buf[i], shard->batch->len[i],
+                                       &shard->batch->from[i]))
+                {
+                    case -1:
+                        shard->stats.dropped++;
+                        break;
+
+                    case 1:
+                        shard_arrive(shard);
+                        break;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Set up an empty shard set with its frame, all of it off.
+ *
+ * @param    set     Shard set.
+ * @param    count   Pixels per channel.
+ *
+ * @returns  eventfd the main thread waits on for frames, -1 on error.
+ */
+int shard_init(shard_set_t *set, const int *count)
+{
+    pthread_condattr_t attr;
+    int chan;
+
+    memset(set, 0, sizeof(*set));
+    set->eventfd = -1;
+
+    // Barrier timeouts are on the monotonic clock
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&set->released, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        set->frame.count[chan] = count[chan];
+        if (count[chan] && !(set->frame.leds[chan] = calloc(count[chan], sizeof(ws2811_led_t))))
+        {
+            shard_stop(set);
+            return -1;
+        }
+    }
+
+    set->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (set->eventfd < 0)
+    {
+        shard_stop(set);
+        return -1;
+    }
+
+    return set->eventfd;
+}
+
+/**
+ * Add a shard servicing a socket.
+ *
+ * @param    set      Shard set.
+ * @param    sockfd   Non-blocking udp socket.
+ * @param    receive  Datagram handler.
+ * @param    arg      Passed to receive.
+ * @param    cpu      CPU to pin the thread to, -1 for any.
+ *
+ * @returns  0 on success, -1 if there are too many or out of memory.
+ */
+int shard_add(shard_set_t *set, int sockfd, shard_receive_t receive, void *arg, int cpu)
+{
+    shard_t *shard;
+
+    if (set->count == SHARD_MAX)
+    {
+        return -1;
+    }
+
+    shard = &set->shard[set->count];
+    // Universes are small, the batch doesn't need room for the largest datagrams
+    shard->batch = malloc(sizeof(*shard->batch));
+    if (!shard->batch || (udp_batch_init(shard->batch, UDP_BATCH_MTU) < 0))
+    {
+        free(shard->batch);
+        shard->batch = NULL;
+        return -1;
+    }
+
+    shard->set = set;
+    shard->sockfd = sockfd;
+    shard->receive = receive;
+    shard->arg = arg;
+    shard->cpu = cpu;
+    udp_batch_watch_overflows(sockfd);
+    set->count++;
+
+    return 0;
+}
+
+/**
+ * Start the threads of the shards added.
+ *
+ * @param    set     Shard set.
+ *
+ * @returns  0 on success, -1 otherwise, with the threads started stopped.
+ */
+int shard_start(shard_set_t *set)
+{
+    int err;
+
+    set->running = 1;
+
+    for (set->started = 0; set->started < set->count; set->started++)
+    {
+        err = pthread_create(&set->shard[set->started].thread, NULL, shard_loop, &set->shard[set->started]);
+        if (err)
+        {
+            fprintf(stderr, "unable to start shard thread: %s\n", strerror(err));
+            shard_stop(set);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the frame held for the main thread and let the shards go on with the
+ * next one.
+ *
+ * @param    set     Shard set.
+ * @param    frame   Frame to copy it into.
+ *
+ * @returns  None
+ */
+void shard_take(shard_set_t *set, frame_t *frame)
+{
+    uint64_t events;
+    int chan, i;
+
+    if (read(set->eventfd, &events, sizeof(events)) < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&set->lock);
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (frame->leds[chan] && set->frame.leds[chan])
+        {
+            memcpy(frame->leds[chan], set->frame.leds[chan], frame->count[chan] * sizeof(ws2811_led_t));
+        }
+    }
+
+    __atomic_store_n(&set->held, 0, __ATOMIC_RELEASE);
+    set->arrived = 0;
+    for (i = 0; i < set->count; i++)
+    {
+        set->shard[i].arrived = 0;
+    }
+    set->generation++;
+    pthread_cond_broadcast(&set->released);
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Stop the threads and free the frame.  The sockets are left to their owners.
+ *
+ * @param    set     Shard set.
+ *
+ * @returns  None
+ */
+void shard_stop(shard_set_t *set)
+{
+    int i, chan;
+
+    pthread_mutex_lock(&set->lock);
+    set->running = 0;
+    pthread_cond_broadcast(&set->released);
+    pthread_mutex_unlock(&set->lock);
+
+    for (i = 0; i < set->started; i++)
+    {
+        pthread_join(set->shard[i].thread, NULL);
+    }
+    set->started = 0;
+
+    for (i = 0; i < set->count; i++)
+    {
+        udp_batch_free(set->shard[i].batch);
+        free(set->shard[i].batch);
+        set->shard[i].batch = NULL;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        free(set->frame.leds[chan]);
+        set->frame.leds[chan] = NULL;
+    }
+
+    if (set->eventfd >= 0)
+    {
+        close(set->eventfd);
+    }
+    set->eventfd = -1;
+}
+
+/**
+ * Add up the receive statistics of the shards.
+ *
+ * @param    set     Shard set.
+ * @param    stats   Totals.
+ *
+ * @returns  None
+ */
+void shard_stats(shard_set_t *set, udp_stats_t *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (i = 0; i < set->count; i++)
+    {
+        stats->packets += set->shard[i].stats.packets;
+        stats->batches += set->shard[i].stats.batches;
+        stats->dropped += set->shard[i].stats.dropped;
+        stats->overflows += set->shard[i].stats.overflows;
+    }
+}
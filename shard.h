@@ -0,0 +1,101 @@
+/*
+ * shard.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "frame.h"
+#include "udpbatch.h"
+
+
+/*
+ * Receive threads, each servicing a socket of its own and writing its own
+ * part of a shared frame.  A thread done with its part of a frame waits at
+ * a barrier for the others, and once all are there the frame is held for
+ * the main thread, which is woken through an eventfd and takes a copy.  A
+ * shard missing the barrier for SHARD_TIMEOUT doesn't hold the others up:
+ * the frame goes out with what its part has then, and it isn't waited for
+ * again until it gets to the barrier by itself, as when its universes
+ * aren't being sent.
+ */
+#define SHARD_MAX                                8
+#define SHARD_TIMEOUT                            100000000ULL   // nS
+#define SHARD_POLL_MS                            100      // Threads look for the stop this often
+
+// Handles a datagram, returns 1 if the shard's part of the frame is done, 0 if not, -1 if invalid
+typedef int (*shard_receive_t)(void *arg, frame_t *frame, const uint8_t *buf, int len,
+                               const struct sockaddr_in *from);
+
+struct shard_set;
+
+typedef struct
+{
+    struct shard_set *set;
+    int sockfd;
+    int cpu;                                     // CPU the thread is pinned to, -1 for any
+    shard_receive_t receive;
+    void *arg;                                   // Passed to receive
+    udp_batch_t *batch;
+    udp_stats_t stats;
+    pthread_t thread;
+    int arrived;                                 // Done with its part of the frame
+    int idle;                                    // Missed the barrier, not waited for
+} shard_t;
+
+typedef struct shard_set
+{
+    shard_t shard[SHARD_MAX];
+    int count;                                   // Shards added
+    int started;                                 // Threads running
+    frame_t frame;                               // Written by the shards, each their own part
+    pthread_mutex_t lock;
+    pthread_cond_t released;                     // A held frame was taken
+    int arrived;                                 // Shards done with their part of the frame
+    int idle;                                    // Shards not waited for
+    int held;                                    // Frame waiting for the main thread
+    unsigned long generation;                    // Frames taken
+    int eventfd;                                 // Readable while a frame is held
+    volatile int running;
+    unsigned long frames;                        // Frames all shards were done with
+    unsigned long forced;                        // Frames held with shards missing
+} shard_set_t;
+
+
+int shard_init(shard_set_t *set, const int *count);
+int shard_add(shard_set_t *set, int sockfd, shard_receive_t receive, void *arg, int cpu);
+int shard_start(shard_set_t *set);
+void shard_take(shard_set_t *set, frame_t *frame);
+void shard_stop(shard_set_t *set);
+void shard_stats(shard_set_t *set, udp_stats_t *stats);
+
+#endif /* __SHARD_H__ */
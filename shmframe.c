@@ -0,0 +1,516 @@
+/*
+ * shmframe.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE                              // memfd_create, accept4
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "shmframe.h"
+#include "asynclog.h"
+
+
+#define SHM_FRAME_FDS                            2        // memfd and eventfd
+
+
+static int shmframe_watch(shmframe_t *shm, int fd)
+{
+    struct epoll_event event =
+    {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+
+    return epoll_ctl(shm->epollfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static ws2811_led_t *shmframe_slot(shm_frame_hdr_t *hdr, size_t slot_offset, size_t slot_size, int slot)
+{
+    return (ws2811_led_t *)((uint8_t *)hdr + slot_offset + slot * slot_size);
+}
+
+/**
+ * Open the unix socket local clients connect to.
+ *
+ * @param    shm     Shared memory state.
+ * @param    path    Socket path, normally SHM_FRAME_PATH.  An old socket there is replaced.
+ * @param    count   Pixels per channel.
+ *
+ * @returns  Epoll fd to wait on for clients and their doorbells on success, -1 otherwise.
+ */
+int shmframe_open(shmframe_t *shm, const char *path, const int *count)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    memset(shm, 0, sizeof(*shm));
+    for (i = 0; i < SHM_FRAME_MAX_CLIENTS; i++)
+    {
+        shm->conns[i].fd = -1;
+    }
+    shm->listenfd = -1;
+
+    if (strlen(path) >= sizeof(shm->path))
+    {
+        fprintf(stderr, "shared memory socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(shm->path, path);
+
+    for (i = 0; i < RPI_PWM_CHANNELS; i++)
+    {
+        shm->count[i] = count[i];
+        shm->slot_size += count[i] * sizeof(ws2811_led_t);
+    }
+
+    // Slots start on a cache line
+    shm->slot_offset = (sizeof(shm_frame_hdr_t) + 63) & ~63;
+    shm->slot_size = (shm->slot_size + 63) & ~63;
+    shm->size = shm->slot_offset + SHM_FRAME_SLOTS * shm->slot_size;
+
+    shm->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (shm->epollfd < 0)
+    {
+        perror("unable to create shared memory epoll fd");
+        return -1;
+    }
+
+    shm->listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (shm->listenfd < 0)
+    {
+        perror("unable to create shared memory socket");
+        shmframe_close(shm);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, shm->path);
+    unlink(shm->path);
+
+    if ((bind(shm->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(shm->listenfd, SHM_FRAME_MAX_CLIENTS) < 0) ||
+        (shmframe_watch(shm, shm->listenfd) < 0))
+    {
+        perror("unable to listen on shared memory socket");
+        shmframe_close(shm);
+        return -1;
+    }
+
+    return shm->epollfd;
+}
+
+static void shmframe_conn_close(shmframe_t *shm, shm_frame_conn_t *conn)
+{
+    munmap(conn->hdr, shm->size);
+    close(conn->eventfd);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+/**
+ * Close the socket and every client connection.
+ *
+ * @param    shm     Shared memory state.
+ *
+ * @returns  None
+ */
+void shmframe_close(shmframe_t *shm)
+{
+    int i;
+
+    for (i = 0; i < SHM_FRAME_MAX_CLIENTS; i++)
+    {
+        if (shm->conns[i].fd >= 0)
+        {
+            shmframe_conn_close(shm, &shm->conns[i]);
+        }
+    }
+
+    if (shm->listenfd >= 0)
+    {
+        close(shm->listenfd);
+        unlink(shm->path);
+        shm->listenfd = -1;
+    }
+
+    if (shm->epollfd >= 0)
+    {
+        close(shm->epollfd);
+        shm->epollfd = -1;
+    }
+}
+
+/**
+ * Set up the shared region and doorbell of a new connection and hand them
+ * to the client.  The region is sealed at its size, so the client can't
+ * shrink it from under the server's mapping.
+ *
+ * @param    shm     Shared memory state.
+ * @param    conn    Connection, its fd is set.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int shmframe_conn_setup(shmframe_t *shm, shm_frame_conn_t *conn)
+{
+    union
+    {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(SHM_FRAME_FDS * sizeof(int))];
+    } control;
+    uint32_t size = shm->size;
+    struct iovec iov = { &size, sizeof(size) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int memfd, i;
+
+    memfd = memfd_create("ws281x-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+    {
+        return -1;
+    }
+
+    if ((ftruncate(memfd, shm->size) < 0) ||
+        (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0))
+    {
+        close(memfd);
+        return -1;
+    }
+
+    conn->hdr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (conn->hdr == MAP_FAILED)
+    {
+        close(memfd);
+        return -1;
+    }
+
+    conn->hdr->magic = SHM_FRAME_MAGIC;
+    conn->hdr->version = SHM_FRAME_VERSION;
+    for (i = 0; i < RPI_PWM_CHANNELS; i++)
+    {
+        conn->hdr->count[i] = shm->count[i];
+    }
+    conn->hdr->slot_offset = shm->slot_offset;
+    conn->hdr->slot_size = shm->slot_size;
+    conn->hdr->pending = 1;
+    conn->read = 2;
+
+    conn->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (conn->eventfd < 0)
+    {
+        munmap(conn->hdr, shm->size);
+        close(memfd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SHM_FRAME_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), (int []){ memfd, conn->eventfd }, SHM_FRAME_FDS * sizeof(int));
+
+    // The mapping keeps the region around
+    i = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+
+    if ((i < 0) || (shmframe_watch(shm, conn->fd) < 0) || (shmframe_watch(shm, conn->eventfd) < 0))
+    {
+        munmap(conn->hdr, shm->size);
+        close(conn->eventfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Accept the waiting connections, turning away clients past
+ * SHM_FRAME_MAX_CLIENTS.
+ *
+ * @param    shm     Shared memory state.
+ *
+ * @returns  None
+ */
+static void shmframe_accept(shmframe_t *shm)
+{
+    int fd, i;
+
+    while ((fd = accept4(shm->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        for (i = 0; i < SHM_FRAME_MAX_CLIENTS; i++)
+        {
+            if (shm->conns[i].fd < 0)
+            {
+                break;
+            }
+        }
+
+        if (i == SHM_FRAME_MAX_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+
+        shm->conns[i].fd = fd;
+        if (shmframe_conn_setup(shm, &shm->conns[i]) < 0)
+        {
+            asynclog_perror("unable to set up shared memory client");
+            close(fd);
+            shm->conns[i].fd = -1;
+        }
+    }
+}
+
+/**
+ * Take the newest frame a client submitted, if there is one.
+ *
+ * @param    shm     Shared memory state.
+ * @param    conn    Connection.
+ * @param    frame   Frame to copy the pixels into.
+ *
+ * @returns  1 if a frame was taken, 0 if none was submitted, -1 if the client
+ *           broke the protocol.
+ */
+static int shmframe_take(shmframe_t *shm, shm_frame_conn_t *conn, frame_t *frame)
+{
+    const ws2811_led_t *pixels;
+    uint64_t rings;
+    int old, count, chan;
+
+    // The doorbell is cleared before looking, so a frame submitted after this rings it again
+    if (read(conn->eventfd, &rings, sizeof(rings)) < 0 && errno != EAGAIN)
+    {
+        return -1;
+    }
+
+    if (!(__atomic_load_n(&conn->hdr->pending, __ATOMIC_ACQUIRE) & SHM_FRAME_FRESH))
+    {
+        return 0;
+    }
+
+    old = __atomic_exchange_n(&conn->hdr->pending, conn->read, __ATOMIC_ACQ_REL);
+    if ((old & SHM_FRAME_INDEX) >= SHM_FRAME_SLOTS)
+    {
+        return -1;
+    }
+    conn->read = old & SHM_FRAME_INDEX;
+
+    // The client doesn't touch this slot until it's handed back
+    pixels = shmframe_slot(conn->hdr, shm->slot_offset, shm->slot_size, conn->read);
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        count = shm->count[chan] < frame->count[chan] ? shm->count[chan] : frame->count[chan];
+        if (frame->leds[chan])
+        {
+            memcpy(frame->leds[chan], pixels, count * sizeof(ws2811_led_t));
+        }
+        pixels += shm->count[chan];
+    }
+
+    shm->frames++;
+
+    return 1;
+}
+
+/**
+ * Accept new clients, drop the ones that went away and take the newest
+ * frame submitted.  Call when the epoll fd from shmframe_open is readable.
+ *
+ * @param    shm     Shared memory state.
+ * @param    frame   Frame to copy the pixels into.
+ *
+ * @returns  1 if a frame was taken, -1 otherwise.
+ */
+int shmframe_poll(shmframe_t *shm, frame_t *frame)
+{
+    shm_frame_conn_t *conn;
+    int complete = 0;
+    uint8_t byte;
+    int i, taken;
+
+    shmframe_accept(shm);
+
+    for (i = 0; i < SHM_FRAME_MAX_CLIENTS; i++)
+    {
+        conn = &shm->conns[i];
+        if (conn->fd < 0)
+        {
+            continue;
+        }
+
+        taken = shmframe_take(shm, conn, frame);
+
+        // Clients don't send anything, the socket only becomes readable when they hang up
+        if ((taken < 0) || (recv(conn->fd, &byte, sizeof(byte), MSG_DONTWAIT) >= 0) ||
+            ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        {
+            shmframe_conn_close(shm, conn);
+            continue;
+        }
+
+        complete |= taken;
+    }
+
+    return complete ? 1 : -1;
+}
+
+/**
+ * Connect to the server and map the frame slots.
+ *
+ * @param    client  Client state.
+ * @param    path    Socket path, normally SHM_FRAME_PATH.
+ *
+ * @returns  Pixels of the first slot to write, channel 0's followed by channel 1's,
+ *           NULL on failure.
+ */
+ws2811_led_t *shmframe_connect(shmframe_client_t *client, const char *path)
+{
+    union
+    {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(SHM_FRAME_FDS * sizeof(int))];
+    } control;
+    struct sockaddr_un addr;
+    uint32_t size;
+    struct iovec iov = { &size, sizeof(size) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[SHM_FRAME_FDS];
+
+    memset(client, 0, sizeof(*client));
+    client->eventfd = -1;
+
+    client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client->fd < 0)
+    {
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if ((connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(size)) ||
+        !(cmsg = CMSG_FIRSTHDR(&msg)) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+        (cmsg->cmsg_len != CMSG_LEN(SHM_FRAME_FDS * sizeof(int))))
+    {
+        close(client->fd);
+        return NULL;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    client->eventfd = fds[1];
+    client->size = size;
+    client->hdr = mmap(NULL, client->size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+
+    if ((client->hdr == MAP_FAILED) || (client->hdr->magic != SHM_FRAME_MAGIC) ||
+        (client->hdr->version != SHM_FRAME_VERSION))
+    {
+        if (client->hdr != MAP_FAILED)
+        {
+            munmap(client->hdr, client->size);
+        }
+        close(client->eventfd);
+        close(client->fd);
+        return NULL;
+    }
+
+    client->write = 0;
+
+    return shmframe_slot(client->hdr, client->hdr->slot_offset, client->hdr->slot_size, client->write);
+}
+
+/**
+ * Submit the frame written into the current slot.  Writing carries on in
+ * another slot, which starts out as a copy of the frame just submitted.
+ * The doorbell is only rung when the server took the previous frame, so
+ * submitting faster than the server takes frames costs no system calls.
+ *
+ * @param    client  Client state.
+ *
+ * @returns  Pixels of the slot to write next, NULL if the server can't be told.
+ */
+ws2811_led_t *shmframe_submit(shmframe_client_t *client)
+{
+    shm_frame_hdr_t *hdr = client->hdr;
+    ws2811_led_t *submitted = shmframe_slot(hdr, hdr->slot_offset, hdr->slot_size, client->write);
+    ws2811_led_t *next;
+    int old;
+
+    old = __atomic_exchange_n(&hdr->pending, client->write | SHM_FRAME_FRESH, __ATOMIC_ACQ_REL);
+    client->write = old & SHM_FRAME_INDEX;
+
+    next = shmframe_slot(hdr, hdr->slot_offset, hdr->slot_size, client->write);
+    memcpy(next, submitted, hdr->slot_size);
+
+    if (!(old & SHM_FRAME_FRESH) &&
+        (write(client->eventfd, &(uint64_t){ 1 }, sizeof(uint64_t)) < 0))
+    {
+        return NULL;
+    }
+
+    return next;
+}
+
+/**
+ * Disconnect from the server.
+ *
+ * @param    client  Client state.
+ *
+ * @returns  None
+ */
+void shmframe_disconnect(shmframe_client_t *client)
+{
+    munmap(client->hdr, client->size);
+    close(client->eventfd);
+    close(client->fd);
+}
@@ -0,0 +1,112 @@
+/*
+ * shmframe.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __SHMFRAME_H__
+#define __SHMFRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "frame.h"
+
+
+/*
+ * Shared memory frame submission for processes on the same host.  A
+ * client connects to a unix seqpacket socket and is handed a memfd and an
+ * eventfd.  The memfd holds a header and SHM_FRAME_SLOTS frame slots used
+ * as a triple buffer, the same way tbuf hands frames to the render thread:
+ * the client writes pixels into its slot, swaps it with the pending slot
+ * using one atomic exchange and rings the eventfd doorbell.  The server
+ * swaps the pending slot with its own when the doorbell rings.
+ *
+ * Slots hold 32-bit pixels in the LED buffer's layout, channel 0's pixels
+ * followed by channel 1's.  The client starts out owning slot 0.
+ */
+#define SHM_FRAME_PATH                           "/run/ws281x_udp_server.sock"
+#define SHM_FRAME_MAGIC                          0x57533238    // "WS28"
+#define SHM_FRAME_VERSION                        1
+#define SHM_FRAME_SLOTS                          3
+#define SHM_FRAME_FRESH                          0x4      // Set in pending by the client, cleared by the server
+#define SHM_FRAME_INDEX                          0x3
+#define SHM_FRAME_MAX_CLIENTS                    4
+
+// Start of the shared region, the slots follow at slot_offset
+typedef struct
+{
+    uint32_t magic;                              // SHM_FRAME_MAGIC
+    uint32_t version;                            // SHM_FRAME_VERSION
+    uint32_t count[RPI_PWM_CHANNELS];            // Pixels per channel
+    uint32_t slot_offset;                        // Offset of slot 0 from the start of the region
+    uint32_t slot_size;                          // Bytes per slot
+    int32_t pending;                             // Slot between client and server
+} shm_frame_hdr_t;
+
+// Server side of a connection
+typedef struct
+{
+    int fd;                                      // Unix socket, -1 if the slot is free
+    int eventfd;                                 // Doorbell the client rings
+    shm_frame_hdr_t *hdr;                        // Shared region
+    int read;                                    // Server's slot
+} shm_frame_conn_t;
+
+typedef struct
+{
+    int epollfd;                                 // Readable when listenfd, a client or a doorbell is
+    int listenfd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int count[RPI_PWM_CHANNELS];
+    size_t slot_offset;                          // Region layout, kept here as clients can write the header
+    size_t slot_size;
+    size_t size;
+    shm_frame_conn_t conns[SHM_FRAME_MAX_CLIENTS];
+    unsigned long frames;                        // Frames taken from clients
+} shmframe_t;
+
+// Client side of a connection
+typedef struct
+{
+    int fd;
+    int eventfd;
+    shm_frame_hdr_t *hdr;
+    size_t size;
+    int write;                                   // Client's slot
+} shmframe_client_t;
+
+
+int shmframe_open(shmframe_t *shm, const char *path, const int *count);
+void shmframe_close(shmframe_t *shm);
+int shmframe_poll(shmframe_t *shm, frame_t *frame);
+
+ws2811_led_t *shmframe_connect(shmframe_client_t *client, const char *path);
+ws2811_led_t *shmframe_submit(shmframe_client_t *client);
+void shmframe_disconnect(shmframe_client_t *client);
+
+#endif /* __SHMFRAME_H__ */
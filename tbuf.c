@@ -0,0 +1,168 @@
+/*
+ * tbuf.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tbuf.h"
+
+
+/**
+ * Allocate the slots of a triple buffer, all of them off.
+ *
+ * @param    tbuf    Triple buffer.
+ * @param    count   Number of LEDs of each channel, RPI_PWM_CHANNELS entries.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+int tbuf_init(tbuf_t *tbuf, const int *count)
+{
+    int i, chan;
+
+    memset(tbuf, 0, sizeof(*tbuf));
+
+    for (i = 0; i < TBUF_SLOTS; i++)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            if (!count[chan])
+            {
+                continue;
+            }
+
+            tbuf->slot[i].leds[chan] = calloc(count[chan], sizeof(ws2811_led_t));
+            if (!tbuf->slot[i].leds[chan])
+            {
+                tbuf_free(tbuf);
+                return -1;
+            }
+            tbuf->slot[i].count[chan] = count[chan];
+        }
+    }
+
+    tbuf->write = 0;
+    tbuf->pending = 1;
+    tbuf->read = 2;
+
+    return 0;
+}
+
+/**
+ * Free the slots of a triple buffer.
+ *
+ * @param    tbuf    Triple buffer.
+ *
+ * @returns  None
+ */
+void tbuf_free(tbuf_t *tbuf)
+{
+    int i, chan;
+
+    for (i = 0; i < TBUF_SLOTS; i++)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            free(tbuf->slot[i].leds[chan]);
+            tbuf->slot[i].leds[chan] = NULL;
+        }
+    }
+}
+
+/**
+ * Frame the writer writes into.
+ *
+ * @param    tbuf    Triple buffer.
+ *
+ * @returns  The writer's frame.
+ */
+frame_t *tbuf_writer(tbuf_t *tbuf)
+{
+    return &tbuf->slot[tbuf->write];
+}
+
+/**
+ * Publish the writer's frame.  The writer carries on in the slot of the
+ * previously published frame, which still holds an older frame, so every
+ * frame has to be written in full.  A frame without a time to show it at
+ * that replaces one the reader didn't take yet takes over its time, so the
+ * newer content still goes out when the replaced frame was due.
+ *
+ * @param    tbuf    Triple buffer.
+ *
+ * @returns  The writer's new frame.
+ */
+frame_t *tbuf_publish(tbuf_t *tbuf)
+{
+    frame_t *frame = &tbuf->slot[tbuf->write];
+    uint64_t present = frame->present;
+    int old;
+
+    old = __atomic_load_n(&tbuf->pending, __ATOMIC_ACQUIRE);
+    do
+    {
+        // The pending slot isn't written while it's pending, only read
+        frame->present = (!present && (old & TBUF_FRESH)) ? tbuf->slot[old & TBUF_INDEX].present : present;
+    }
+    while (!__atomic_compare_exchange_n(&tbuf->pending, &old, tbuf->write | TBUF_FRESH, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    tbuf->published++;
+    if (old & TBUF_FRESH)
+    {
+        tbuf->superseded++;
+    }
+
+    tbuf->write = old & TBUF_INDEX;
+
+    return &tbuf->slot[tbuf->write];
+}
+
+/**
+ * Take the newest published frame for the reader, giving back the one it
+ * had.
+ *
+ * @param    tbuf    Triple buffer.
+ *
+ * @returns  The newest frame, NULL if none was published since the last call.
+ */
+frame_t *tbuf_acquire(tbuf_t *tbuf)
+{
+    int old;
+
+    if (!(__atomic_load_n(&tbuf->pending, __ATOMIC_ACQUIRE) & TBUF_FRESH))
+    {
+        return NULL;
+    }
+
+    old = __atomic_exchange_n(&tbuf->pending, tbuf->read, __ATOMIC_ACQ_REL);
+    tbuf->read = old & TBUF_INDEX;
+
+    return &tbuf->slot[tbuf->read];
+}
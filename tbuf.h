@@ -0,0 +1,69 @@
+/*
+ * tbuf.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TBUF_H__
+#define __TBUF_H__
+
+#include <stdint.h>
+
+#include "frame.h"
+
+
+/*
+ * Lock-free triple buffer handing frames from one writer thread to one
+ * reader thread.  The writer always has a slot of its own to write into,
+ * the reader one to render from, and the third slot holds the newest
+ * published frame.  Publishing and acquiring swap slots with a single
+ * atomic exchange or compare and swap, so neither side ever waits for the
+ * other.  A frame published while the previous one wasn't picked up yet
+ * replaces it, and keeps its present time if it has none of its own.
+ */
+#define TBUF_SLOTS                               3
+
+typedef struct
+{
+    frame_t slot[TBUF_SLOTS];
+    int write;                                   // Writer's slot, only touched by the writer
+    int read;                                    // Reader's slot, only touched by the reader
+    int pending;                                 // Slot between them, TBUF_FRESH if not yet read
+    unsigned long published;                     // Frames published, writer side
+    unsigned long superseded;                    // Published frames replaced before they were read
+} tbuf_t;
+
+#define TBUF_FRESH                               0x4      // Set in pending by publish, cleared by acquire
+#define TBUF_INDEX                               0x3
+
+
+int tbuf_init(tbuf_t *tbuf, const int *count);
+void tbuf_free(tbuf_t *tbuf);
+frame_t *tbuf_writer(tbuf_t *tbuf);
+frame_t *tbuf_publish(tbuf_t *tbuf);
+frame_t *tbuf_acquire(tbuf_t *tbuf);
+
+#endif /* __TBUF_H__ */
@@ -0,0 +1,255 @@
+/*
+ * timesync.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "timesync.h"
+
+
+static uint64_t timesync_clock(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Set up the shared clock.
+ *
+ * @param    ts      Clock state.
+ * @param    master  "host[:port]" of the controller to follow, NULL for the system clock.
+ * @param    port    Udp port of the controller if master doesn't give one.
+ *
+ * @returns  0 on success, -1 if master can't be resolved.
+ */
+int timesync_init(timesync_t *ts, const char *master, int port)
+{
+    struct addrinfo hints, *res;
+    char host[256], *colon;
+
+    memset(ts, 0, sizeof(*ts));
+    if (!master)
+    {
+        return 0;
+    }
+
+    snprintf(host, sizeof(host), "%s", master);
+    colon = strrchr(host, ':');
+    if (colon)
+    {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if ((port < 1) || (port > 65535) || getaddrinfo(host, NULL, &hints, &res))
+    {
+        return -1;
+    }
+
+    memcpy(&ts->master, res->ai_addr, sizeof(ts->master));
+    ts->master.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/**
+ * Check if a datagram is a time request or reply.
+ *
+ * @param    buf   Datagram.
+ * @param    len   Datagram length.
+ *
+ * @returns  1 if it is, 0 otherwise.
+ */
+int timesync_is_message(const uint8_t *buf, int len)
+{
+    return (len >= sizeof(timesync_msg_t)) && (buf[0] == TIMESYNC_MAGIC);
+}
+
+/**
+ * Current time on the shared clock.
+ *
+ * @param    ts      Clock state.
+ *
+ * @returns  Shared clock time (nS).
+ */
+uint64_t timesync_now(timesync_t *ts)
+{
+    return timesync_clock(CLOCK_REALTIME) + ts->best;
+}
+
+/**
+ * Answer a time request, or take a sample from the reply to ours.
+ *
+ * @param    ts      Clock state.
+ * @param    sockfd  Socket the message came in on, replies go out on it.
+ * @param    buf     Message.
+ * @param    len     Message length.
+ * @param    from    Sender.
+ *
+ * @returns  None
+ */
+void timesync_receive(timesync_t *ts, int sockfd, const uint8_t *buf, int len, const struct sockaddr_in *from)
+{
+    const timesync_msg_t *msg = (const timesync_msg_t *)buf;
+    timesync_msg_t reply;
+    int64_t t1, t2, t3, t4, delay;
+    int i;
+
+    if (!timesync_is_message(buf, len) || (msg->version != TIMESYNC_VERSION))
+    {
+        return;
+    }
+
+    if (msg->type == TIMESYNC_REQUEST)
+    {
+        memset(&reply, 0, sizeof(reply));
+        reply.magic = TIMESYNC_MAGIC;
+        reply.version = TIMESYNC_VERSION;
+        reply.type = TIMESYNC_REPLY;
+        reply.origin = msg->origin;
+        reply.receive = htobe64(timesync_now(ts));
+        reply.transmit = htobe64(timesync_now(ts));
+
+        sendto(sockfd, &reply, sizeof(reply), 0, (const struct sockaddr *)from, sizeof(*from));
+        return;
+    }
+
+    if ((msg->type != TIMESYNC_REPLY) || !ts->master.sin_port ||
+        (from->sin_addr.s_addr != ts->master.sin_addr.s_addr) || (from->sin_port != ts->master.sin_port))
+    {
+        return;
+    }
+
+    // Offset and round trip the way NTP works them out, with t1 and t4 on our clock
+    t1 = be64toh(msg->origin);
+    t2 = be64toh(msg->receive);
+    t3 = be64toh(msg->transmit);
+    t4 = timesync_clock(CLOCK_REALTIME);
+
+    delay = (t4 - t1) - (t3 - t2);
+    if ((delay < 0) || (t1 > t4))
+    {
+        return;
+    }
+
+    ts->offset[ts->next] = ((t2 - t1) + (t3 - t4)) / 2;
+    ts->delay[ts->next] = delay;
+    ts->next = (ts->next + 1) % TIMESYNC_SAMPLES;
+    if (ts->samples < TIMESYNC_SAMPLES)
+    {
+        ts->samples++;
+    }
+    ts->replies++;
+
+    // The shortest round trip was queued the least, its offset is the most accurate
+    delay = -1;
+    for (i = 0; i < ts->samples; i++)
+    {
+        if ((delay < 0) || (ts->delay[i] < delay))
+        {
+            delay = ts->delay[i];
+            ts->best = ts->offset[i];
+        }
+    }
+}
+
+/**
+ * Send a time request to the controller followed, if there is one.
+ *
+ * @param    ts      Clock state.
+ * @param    sockfd  Socket to send it on, the reply comes back there.
+ *
+ * @returns  None
+ */
+void timesync_request(timesync_t *ts, int sockfd)
+{
+    timesync_msg_t msg;
+
+    if (!ts->master.sin_port)
+    {
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = TIMESYNC_MAGIC;
+    msg.version = TIMESYNC_VERSION;
+    msg.type = TIMESYNC_REQUEST;
+    msg.origin = htobe64(timesync_clock(CLOCK_REALTIME));
+
+    if (sendto(sockfd, &msg, sizeof(msg), 0, (struct sockaddr *)&ts->master, sizeof(ts->master)) == sizeof(msg))
+    {
+        ts->requests++;
+    }
+}
+
+/**
+ * Convert a time on the shared clock to CLOCK_MONOTONIC, which the server
+ * schedules by.
+ *
+ * @param    ts      Clock state.
+ * @param    t       Shared clock time (nS).
+ *
+ * @returns  CLOCK_MONOTONIC time (nS), now for times already past, 0 while the
+ *           controller followed hasn't replied yet.
+ */
+uint64_t timesync_local(timesync_t *ts, uint64_t t)
+{
+    uint64_t now, shared;
+
+    if (ts->master.sin_port && !ts->samples)
+    {
+        return 0;
+    }
+
+    now = timesync_clock(CLOCK_MONOTONIC);
+    shared = timesync_now(ts);
+
+    // Subtracting a time further back than the monotonic clock goes would wrap
+    if (t <= shared)
+    {
+        return now;
+    }
+
+    return t - shared + now;
+}
@@ -0,0 +1,84 @@
+/*
+ * timesync.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TIMESYNC_H__
+#define __TIMESYNC_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+
+/*
+ * Shared clock for timestamped frames, in nanoseconds.  By default it's
+ * CLOCK_REALTIME, for hosts kept in sync by NTP or PTP.  Following a
+ * controller instead, the server sends it time requests and estimates the
+ * offset between the two clocks from the replies, NTP style, keeping the
+ * sample with the shortest round trip out of the last TIMESYNC_SAMPLES.
+ * The server answers time requests on the udp port itself, so one server
+ * can be the clock the others follow.
+ */
+#define TIMESYNC_MAGIC                           0xa6     // Not printable, can't start an animation name
+#define TIMESYNC_VERSION                         1
+#define TIMESYNC_REQUEST                         1
+#define TIMESYNC_REPLY                           2
+#define TIMESYNC_SAMPLES                         8
+
+// All fields in network byte order
+typedef struct
+{
+    uint8_t magic;                               // TIMESYNC_MAGIC
+    uint8_t version;                             // TIMESYNC_VERSION
+    uint8_t type;                                // TIMESYNC_REQUEST or TIMESYNC_REPLY
+    uint8_t reserved[5];
+    uint64_t origin;                             // Requester's clock when it sent the request
+    uint64_t receive;                            // Responder's clock when the request arrived
+    uint64_t transmit;                           // Responder's clock when it sent the reply
+} __attribute__((packed)) timesync_msg_t;
+
+typedef struct
+{
+    struct sockaddr_in master;                   // Clock followed, no port for the system clock
+    int64_t offset[TIMESYNC_SAMPLES];            // Master's clock minus ours (nS)
+    int64_t delay[TIMESYNC_SAMPLES];             // Round trip of the sample (nS)
+    int samples;                                 // Valid samples
+    int next;                                    // Sample replaced next
+    int64_t best;                                // Offset of the shortest round trip
+    unsigned long requests;                      // Requests sent
+    unsigned long replies;                       // Replies used
+} timesync_t;
+
+
+int timesync_init(timesync_t *ts, const char *master, int port);
+int timesync_is_message(const uint8_t *buf, int len);
+void timesync_receive(timesync_t *ts, int sockfd, const uint8_t *buf, int len, const struct sockaddr_in *from);
+void timesync_request(timesync_t *ts, int sockfd);
+uint64_t timesync_now(timesync_t *ts);
+uint64_t timesync_local(timesync_t *ts, uint64_t t);
+
+#endif /* __TIMESYNC_H__ */
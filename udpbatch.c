@@ -0,0 +1,208 @@
+/*
+ * udpbatch.c
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE                              // recvmmsg
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "udpbatch.h"
+#include "asynclog.h"
+
+
+/**
+ * Allocate the datagram buffers of a batch.  Size them for what the socket
+ * receives, a batch of the largest udp datagrams takes a megabyte.
+ *
+ * @param    batch    Batch to set up.
+ * @param    bufsize  Largest datagram to take, UDP_BATCH_BUFSIZE for any.
+ *
+ * @returns  0 on success, -1 if out of memory.
+ */
+int udp_batch_init(udp_batch_t *batch, int bufsize)
+{
+    int i;
+
+    memset(batch, 0, sizeof(*batch));
+
+    batch->buf[0] = malloc(UDP_BATCH_SIZE * (bufsize + 1));
+    if (!batch->buf[0])
+    {
+        return -1;
+    }
+
+    for (i = 1; i < UDP_BATCH_SIZE; i++)
+    {
+        batch->buf[i] = batch->buf[0] + i * (bufsize + 1);
+    }
+    batch->bufsize = bufsize;
+
+    return 0;
+}
+
+/**
+ * Free the datagram buffers of a batch.
+ *
+ * @param    batch   Batch.
+ *
+ * @returns  None
+ */
+void udp_batch_free(udp_batch_t *batch)
+{
+    free(batch->buf[0]);
+    memset(batch->buf, 0, sizeof(batch->buf));
+}
+
+/**
+ * Have the kernel tell how many datagrams it dropped on a socket because
+ * the receive buffer was full, see udp_stats_t overflows.
+ *
+ * @param    sockfd  Udp socket.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+int udp_batch_watch_overflows(int sockfd)
+{
+    int optval = 1;
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval));
+}
+
+/**
+ * Pick the kernel's drop count out of a datagram's control messages.
+ *
+ * @param    msg     Received message.
+ * @param    stats   Statistics to update.
+ *
+ * @returns  None
+ */
+static void udp_batch_overflows(struct msghdr *msg, udp_stats_t *stats)
+{
+    struct cmsghdr *cmsg;
+    uint32_t rxq_ovfl;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL))
+        {
+            memcpy(&rxq_ovfl, CMSG_DATA(cmsg), sizeof(rxq_ovfl));
+            stats->overflows += (uint32_t)(rxq_ovfl - stats->rxq_ovfl);
+            stats->rxq_ovfl = rxq_ovfl;
+        }
+    }
+}
+
+/**
+ * Receive the datagrams waiting on a non-blocking socket, up to
+ * UDP_BATCH_SIZE of them.  Each datagram is NUL terminated so text
+ * commands can be used as strings, ones longer than the batch takes are
+ * dropped.
+ *
+ * @param    batch   Batch to fill.
+ * @param    sockfd  Non-blocking udp socket.
+ * @param    stats   Statistics to update.
+ *
+ * @returns  Number of datagrams received, 0 if none were waiting, -1 on error.
+ */
+int udp_batch_receive(udp_batch_t *batch, int sockfd, udp_stats_t *stats)
+{
+    int i, n;
+
+    for (i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+        batch->iov[i].iov_base = batch->buf[i];
+        batch->iov[i].iov_len = batch->bufsize;
+
+        memset(&batch->msgs[i].msg_hdr, 0, sizeof(batch->msgs[i].msg_hdr));
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->from[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->from[i]);
+        batch->msgs[i].msg_hdr.msg_control = batch->control[i];
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->control[i]);
+    }
+
+    batch->count = 0;
+
+    n = recvmmsg(sockfd, batch->msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        {
+            return 0;
+        }
+
+        asynclog_perror("recvmmsg");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        batch->len[i] = batch->msgs[i].msg_len;
+        if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            batch->len[i] = -1;
+            stats->dropped++;
+        }
+        else
+        {
+            batch->buf[i][batch->len[i]] = '\0';
+        }
+    }
+
+    if (n)
+    {
+        udp_batch_overflows(&batch->msgs[n - 1].msg_hdr, stats);
+        stats->packets += n;
+        stats->batches++;
+    }
+
+    batch->count = n;
+
+    return n;
+}
+
+/**
+ * Print a socket's statistics.
+ *
+ * @param    name    What the socket receives.
+ * @param    stats   Statistics.
+ *
+ * @returns  None
+ */
+void udp_batch_print_stats(const char *name, const udp_stats_t *stats)
+{
+    printf("%s: %lu packets in %lu batches, %lu direct, %lu coalesced, %lu dropped, %lu overflowed\n",
+           name, stats->packets, stats->batches, stats->direct, stats->coalesced, stats->dropped,
+           stats->overflows);
+}
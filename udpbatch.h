@@ -0,0 +1,78 @@
+/*
+ * udpbatch.h
+ *
+ * Copyright (c) 2017 Jetty 
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __UDPBATCH_H__
+#define __UDPBATCH_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+
+/*
+ * Receive the datagrams waiting on a socket with one recvmmsg call into
+ * preallocated buffers, so a burst can be looked at as a whole before any
+ * of it is acted on.  recvmmsg needs _GNU_SOURCE defined before the system
+ * headers are included.
+ */
+#define UDP_BATCH_SIZE                           16
+#define UDP_BATCH_BUFSIZE                        65536    // Largest udp datagram
+#define UDP_BATCH_MTU                            1500     // Largest unfragmented one, DMX universes and DDP fit
+
+typedef struct
+{
+    unsigned long packets;                       // Datagrams received
+    unsigned long batches;                       // recvmmsg calls that returned datagrams
+    unsigned long direct;                        // Received straight into the LED buffer instead
+    unsigned long coalesced;                     // Superseded by a newer one in the same batch
+    unsigned long dropped;                       // Truncated, invalid or stale
+    unsigned long overflows;                     // Dropped by the kernel, socket buffer full
+    uint32_t rxq_ovfl;                           // Last SO_RXQ_OVFL count seen
+} udp_stats_t;
+
+typedef struct
+{
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iov[UDP_BATCH_SIZE];
+    struct sockaddr_in from[UDP_BATCH_SIZE];
+    uint8_t control[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t))];
+    uint8_t *buf[UDP_BATCH_SIZE];                // bufsize + 1 bytes each
+    int bufsize;                                 // Largest datagram taken, longer ones are truncated
+    int len[UDP_BATCH_SIZE];                     // Datagram length, -1 if truncated
+    int count;                                   // Datagrams in the batch
+} udp_batch_t;
+
+
+int udp_batch_init(udp_batch_t *batch, int bufsize);
+void udp_batch_free(udp_batch_t *batch);
+int udp_batch_watch_overflows(int sockfd);
+int udp_batch_receive(udp_batch_t *batch, int sockfd, udp_stats_t *stats);
+void udp_batch_print_stats(const char *name, const udp_stats_t *stats);
+
+#endif /* __UDPBATCH_H__ */
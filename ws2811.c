@@ -30,6 +30,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -55,6 +56,9 @@
 
 #define BUS_TO_PHYS(x)                           ((x)&~0xC0000000)
 
+#define MIN(a, b)                                ((a) < (b) ? (a) : (b))
+#define MAX(a, b)                                ((a) > (b) ? (a) : (b))
+
 #define OSC_FREQ                                 19200000   // crystal frequency
 
 /* 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
@@ -66,6 +70,10 @@
 /* Minimum time to wait for reset to occur in microseconds. */
 #define LED_RESET_WAIT_TIME                      300
 
+// ws2811_render_at() sleeps until this long before the start time, then spins.
+// Enough to cover the wakeup latency of a non-realtime kernel.
+#define RENDER_SPIN_NS                           200000
+
 // Pad out to the nearest uint32 + 32-bits for idle low/high times the number of channels
 #define PWM_BYTE_COUNT(leds, freq)               (((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4) * \
                                                   RPI_PWM_CHANNELS)
@@ -106,14 +114,65 @@ typedef struct ws2811_device
     volatile pwm_t *pwm;
     volatile pcm_t *pcm;
     int spi_fd;
+    volatile uint8_t *periph;
+    uint32_t periph_size;
     volatile dma_cb_t *dma_cb;
     uint32_t dma_cb_addr;
     volatile gpio_t *gpio;
     volatile cm_clk_t *cm_clk;
     videocore_mbox_t mbox;
     int max_count;
+    uint32_t freq;                               // Settings the hardware was last set up with
+    int dmanum;
+    int gpionum[RPI_PWM_CHANNELS];
+    int invert[RPI_PWM_CHANNELS];
+    int count[RPI_PWM_CHANNELS];
+    ws2811_led_t *leds_alloc[RPI_PWM_CHANNELS];  // LED buffers owned by the driver
+    struct ws2811_palette *palette[RPI_PWM_CHANNELS];
 } ws2811_device_t;
 
+// Palette for WS2811_PIXEL_INDEX8 frames along with its encoded symbols
+typedef struct ws2811_palette
+{
+    ws2811_led_t colors[WS2811_PALETTE_SIZE];
+    uint32_t symbols[WS2811_PALETTE_SIZE][LED_COLOURS];  // Symbols of each wire order color byte
+    int strip_type;                              // Channel settings the symbols were built for
+    int invert;
+    uint8_t brightness;
+} ws2811_palette_t;
+
+// Raw buffer output position while encoding
+typedef struct
+{
+    volatile uint32_t *wordptr;                  // Next word (PWM & PCM)
+    volatile uint8_t *byteptr;                   // Next byte (SPI)
+    int stride;                                  // Words between two words of the same channel
+    uint64_t acc;                                // Pending symbol bits, first one in bit 63
+    int bits;                                    // Number of pending bits
+} symbol_writer_t;
+
+// Symbols for each color byte value, see symbol_lut_init()
+static uint32_t symbol_lut[256];
+
+// Bytes per pixel and byte offset of B, G, R and W (indexed by shift / 8) for each pixel format
+static const int pixel_format_size[] =
+{
+    [WS2811_PIXEL_LED]      = 4,
+    [WS2811_PIXEL_RGB888]   = 3,
+    [WS2811_PIXEL_GRB888]   = 3,
+    [WS2811_PIXEL_RGBW8888] = 4,
+    [WS2811_PIXEL_INDEX8]   = 1,
+};
+
+static const int pixel_format_offset[][4] =
+{
+    [WS2811_PIXEL_LED]      = { 0, 1, 2, 3 },
+    [WS2811_PIXEL_RGB888]   = { 2, 1, 0, -1 },
+    [WS2811_PIXEL_GRB888]   = { 2, 0, 1, -1 },
+    [WS2811_PIXEL_RGBW8888] = { 2, 1, 0, 3 },
+    [WS2811_PIXEL_INDEX8]   = { -1, -1, -1, -1 },
+};
+
 /**
  * Provides monotonic timestamp in microseconds.
  *
@@ -130,6 +189,51 @@ static uint64_t get_microsecond_timestamp()
     return t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
 
+/**
+ * Provides the CLOCK_MONOTONIC time in nanoseconds, the clock ws2811_render_at()
+ * start times are on.
+ *
+ * @returns  Current time in nanoseconds or 0 on error.
+ */
+static uint64_t get_nanosecond_timestamp(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) != 0) {
+        return 0;
+    }
+
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * Wait until the given CLOCK_MONOTONIC time.  Sleeps on the absolute deadline
+ * until RENDER_SPIN_NS before it, so the sleep doesn't drift, and spins on the
+ * clock for the rest, so the wakeup latency doesn't add to it.
+ *
+ * @param    start_ns  Time to return at in nanoseconds.
+ *
+ * @returns  None
+ */
+static void wait_until(uint64_t start_ns)
+{
+    struct timespec t;
+
+    if (start_ns > RENDER_SPIN_NS)
+    {
+        t.tv_sec = (start_ns - RENDER_SPIN_NS) / 1000000000ULL;
+        t.tv_nsec = (start_ns - RENDER_SPIN_NS) % 1000000000ULL;
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+        {
+        }
+    }
+
+    while (get_nanosecond_timestamp() < start_ns)
+    {
+    }
+}
+
 /**
  * Iterate through the channels and find the largest led count.
  *
@@ -153,7 +257,9 @@ static int max_channel_led_count(ws2811_t *ws2811)
 }
 
 /**
- * Map all devices into userspace memory.
+ * Map all devices into userspace memory.  All of the register blocks live in
+ * the same peripheral window, so map the span covering them once and derive
+ * each register pointer from it.
  * Not called for SPI
  *
  * @param    ws2811  ws2811 instance pointer.
@@ -163,61 +269,61 @@ static int max_channel_led_count(ws2811_t *ws2811)
 static int map_registers(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
-    const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
     uint32_t base = ws2811->rpi_hw->periph_base;
-    uint32_t dma_addr;
-    uint32_t offset = 0;
-
-    dma_addr = dmanum_to_offset(ws2811->dmanum);
-    if (!dma_addr)
-    {
-        return -1;
-    }
-    dma_addr += rpi_hw->periph_base;
+    uint32_t dma_offset, ctl_offset, ctl_size, clk_offset;
+    uint32_t start, end;
+    volatile uint8_t *periph;
 
-    device->dma = mapmem(dma_addr, sizeof(dma_t));
-    if (!device->dma)
+    dma_offset = dmanum_to_offset(ws2811->dmanum);
+    if (!dma_offset)
     {
         return -1;
     }
 
     switch (device->driver_mode) {
     case PWM:
-        device->pwm = mapmem(PWM_OFFSET + base, sizeof(pwm_t));
-        if (!device->pwm)
-        {
-            return -1;
-        }
+        ctl_offset = PWM_OFFSET;
+        ctl_size = sizeof(pwm_t);
+        clk_offset = CM_PWM_OFFSET;
         break;
 
     case PCM:
-        device->pcm = mapmem(PCM_OFFSET + base, sizeof(pcm_t));
-        if (!device->pcm)
-        {
-            return -1;
-        }
+        ctl_offset = PCM_OFFSET;
+        ctl_size = sizeof(pcm_t);
+        clk_offset = CM_PCM_OFFSET;
         break;
+
+    default:
+        return -1;
     }
 
-    device->gpio = mapmem(GPIO_OFFSET + base, sizeof(gpio_t));
-    if (!device->gpio)
+    // Find the page aligned span covering every block we need
+    start = MIN(MIN(dma_offset, ctl_offset), MIN(GPIO_OFFSET, clk_offset)) & PAGE_MASK;
+    end = MAX(MAX(dma_offset + sizeof(dma_t), ctl_offset + ctl_size),
+              MAX(GPIO_OFFSET + sizeof(gpio_t), clk_offset + sizeof(cm_clk_t)));
+    end = (end + (PAGE_SIZE - 1)) & PAGE_MASK;
+
+    periph = mapmem(base + start, end - start);
+    if (!periph)
     {
         return -1;
     }
+    device->periph = periph;
+    device->periph_size = end - start;
+
+    device->dma = (volatile dma_t *)(periph + dma_offset - start);
+    device->gpio = (volatile gpio_t *)(periph + GPIO_OFFSET - start);
+    device->cm_clk = (volatile cm_clk_t *)(periph + clk_offset - start);
 
     switch (device->driver_mode) {
     case PWM:
-        offset = CM_PWM_OFFSET;
+        device->pwm = (volatile pwm_t *)(periph + ctl_offset - start);
         break;
+
     case PCM:
-        offset = CM_PCM_OFFSET;
+        device->pcm = (volatile pcm_t *)(periph + ctl_offset - start);
         break;
     }
-    device->cm_clk = mapmem(offset + base, sizeof(cm_clk_t));
-    if (!device->cm_clk)
-    {
-        return -1;
-    }
 
     return 0;
 }
@@ -233,30 +339,17 @@ static void unmap_registers(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
 
-    if (device->dma)
-    {
-        unmapmem((void *)device->dma, sizeof(dma_t));
-    }
-
-    if (device->pwm)
-    {
-        unmapmem((void *)device->pwm, sizeof(pwm_t));
-    }
-
-    if (device->pcm)
-    {
-        unmapmem((void *)device->pcm, sizeof(pcm_t));
-    }
-
-    if (device->cm_clk)
+    if (device->periph)
     {
-        unmapmem((void *)device->cm_clk, sizeof(cm_clk_t));
+        unmapmem((void *)device->periph, device->periph_size);
     }
 
-    if (device->gpio)
-    {
-        unmapmem((void *)device->gpio, sizeof(gpio_t));
-    }
+    device->periph = NULL;
+    device->dma = NULL;
+    device->pwm = NULL;
+    device->pcm = NULL;
+    device->gpio = NULL;
+    device->cm_clk = NULL;
 }
 
 /**
@@ -464,18 +557,16 @@ static int setup_pcm(ws2811_t *ws2811)
 }
 
 /**
- * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
- * PWM channels.
+ * Reset the DMA controller and load the control block, ready for dma_start().
  *
  * @param    ws2811  ws2811 instance pointer.
  *
  * @returns  None
  */
-static void dma_start(ws2811_t *ws2811)
+static void dma_prepare(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile pcm_t *pcm = device->pcm;
     uint32_t dma_cb_addr = device->dma_cb_addr;
 
     dma->cs = RPI_DMA_CS_RESET;
@@ -486,6 +577,23 @@ static void dma_start(ws2811_t *ws2811)
 
     dma->conblk_ad = dma_cb_addr;
     dma->debug = 7; // clear debug error flags
+}
+
+/**
+ * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
+ * PWM channels.  The controller has to be set up with dma_prepare() first, this only
+ * writes the registers that start the output, so the start can be timed.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void dma_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    volatile pcm_t *pcm = device->pcm;
+
     dma->cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
               RPI_DMA_CS_PANIC_PRIORITY(15) |
               RPI_DMA_CS_PRIORITY(15) |
@@ -590,6 +698,123 @@ void pcm_raw_init(ws2811_t *ws2811)
     }
 }
 
+/**
+ * Derive the color shift values from the channel strip type.
+ *
+ * @param    channel  channel pointer.
+ *
+ * @returns  None
+ */
+static void channel_set_shifts(ws2811_channel_t *channel)
+{
+    if (!channel->strip_type)
+    {
+      channel->strip_type=WS2811_STRIP_RGB;
+    }
+
+    channel->wshift = (channel->strip_type >> 24) & 0xff;
+    channel->rshift = (channel->strip_type >> 16) & 0xff;
+    channel->gshift = (channel->strip_type >> 8)  & 0xff;
+    channel->bshift = (channel->strip_type >> 0)  & 0xff;
+}
+
+/**
+ * Remember the settings the hardware was set up with, so that a later
+ * reconfigure only touches what changed.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void device_save_config(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    device->freq = ws2811->freq;
+    device->dmanum = ws2811->dmanum;
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        device->gpionum[chan] = ws2811->channel[chan].gpionum;
+        device->invert[chan] = ws2811->channel[chan].invert;
+        device->count[chan] = ws2811->channel[chan].count;
+    }
+}
+
+/**
+ * Size of the DMA capable buffer needed for the control block and the raw
+ * bit stream, rounded up to whole pages.
+ *
+ * @param    ws2811     ws2811 instance pointer.
+ * @param    max_count  Largest channel LED count.
+ *
+ * @returns  Buffer size in bytes.
+ */
+static uint32_t videocore_buffer_size(ws2811_t *ws2811, int max_count)
+{
+    uint32_t size = sizeof(dma_cb_t);
+
+    switch (ws2811->device->driver_mode) {
+    case PWM:
+        size += PWM_BYTE_COUNT(max_count, ws2811->freq);
+        break;
+
+    case PCM:
+        size += PCM_BYTE_COUNT(max_count, ws2811->freq);
+        break;
+    }
+
+    return (size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+}
+
+/**
+ * Allocate, lock and map VideoCore memory of mbox->size bytes using the
+ * already opened mbox->handle.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    mbox    Mailbox allocation to fill in.
+ *
+ * @returns  WS2811_SUCCESS on success, error otherwise with nothing allocated.
+ */
+static ws2811_return_t videocore_alloc(ws2811_t *ws2811, videocore_mbox_t *mbox)
+{
+    mbox->mem_ref = mem_alloc(mbox->handle, mbox->size, PAGE_SIZE,
+                              ws2811->rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
+    if (mbox->mem_ref == 0)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    mbox->bus_addr = mem_lock(mbox->handle, mbox->mem_ref);
+    if (mbox->bus_addr == (uint32_t) ~0UL)
+    {
+        mem_free(mbox->handle, mbox->mem_ref);
+        return WS2811_ERROR_MEM_LOCK;
+    }
+
+    mbox->virt_addr = mapmem(BUS_TO_PHYS(mbox->bus_addr), mbox->size);
+    if (!mbox->virt_addr)
+    {
+        mem_unlock_free(mbox->handle, mbox->mem_ref);
+        return WS2811_ERROR_MMAP;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Release memory allocated by videocore_alloc().  The mailbox stays open.
+ *
+ * @param    mbox    Mailbox allocation to release.
+ *
+ * @returns  None
+ */
+static void videocore_free(videocore_mbox_t *mbox)
+{
+    unmapmem(mbox->virt_addr, mbox->size);
+    mem_unlock_free(mbox->handle, mbox->mem_ref);
+}
+
 /**
  * Cleanup previously allocated device memory and buffers.
  *
@@ -602,22 +827,25 @@ void ws2811_cleanup(ws2811_t *ws2811)
     ws2811_device_t *device = ws2811->device;
     int chan;
 
+    // Buffers attached with ws2811_set_leds() belong to the application
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        if (ws2811->channel && ws2811->channel[chan].leds)
+        if (device->leds_alloc[chan])
         {
-            free(ws2811->channel[chan].leds);
+            free(device->leds_alloc[chan]);
         }
+        device->leds_alloc[chan] = NULL;
         ws2811->channel[chan].leds = NULL;
+
+        free(device->palette[chan]);
+        device->palette[chan] = NULL;
     }
 
     if (device->mbox.handle != -1)
     {
         videocore_mbox_t *mbox = &device->mbox;
 
-        unmapmem(mbox->virt_addr, mbox->size);
-        mem_unlock(mbox->handle, mbox->mem_ref);
-        mem_free(mbox->handle, mbox->mem_ref);
+        videocore_free(mbox);
         mbox_close(mbox->handle);
 
         mbox->handle = -1;
@@ -770,6 +998,7 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
     // Initialize device structure elements to not used
     // except driver_mode, spi_fd and max_count (already defined when spi_init called)
     device->pxl_raw = NULL;
+    device->periph = NULL;
     device->dma = NULL;
     device->pwm = NULL;
     device->pcm = NULL;
@@ -778,25 +1007,21 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
     device->gpio = NULL;
     device->cm_clk = NULL;
     device->mbox.handle = -1;
+    device->leds_alloc[1] = NULL;
+    device->palette[0] = NULL;
+    device->palette[1] = NULL;
 
     // Allocate LED buffer
     ws2811_channel_t *channel = &ws2811->channel[0];
     channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
+    device->leds_alloc[0] = channel->leds;
     if (!channel->leds)
     {
         ws2811_cleanup(ws2811);
 	return WS2811_ERROR_OUT_OF_MEMORY;
     }
     memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
-    if (!channel->strip_type)
-    {
-      channel->strip_type=WS2811_STRIP_RGB;
-    }
-
-    channel->wshift = (channel->strip_type >> 24) & 0xff;
-    channel->rshift = (channel->strip_type >> 16) & 0xff;
-    channel->gshift = (channel->strip_type >> 8)  & 0xff;
-    channel->bshift = (channel->strip_type >> 0)  & 0xff;
+    channel_set_shifts(channel);
 
     // Allocate SPI transmit buffer (same size as PCM)
     device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_count, ws2811->freq));
@@ -807,6 +1032,8 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
     }
     pcm_raw_init(ws2811);
 
+    device_save_config(ws2811);
+
     return WS2811_SUCCESS;
 }
 
@@ -831,102 +1058,457 @@ static ws2811_return_t spi_transfer(ws2811_t *ws2811)
 }    
 
 
-/*
- *
- * Application API Functions
- *
- */
-
-
 /**
- * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
- *
- * @param    ws2811  ws2811 instance pointer.
+ * Build the symbol lookup table.  Every color byte turns into 8 bits of 3
+ * symbols each, so the encoder emits 24 bits per byte with one lookup
+ * instead of assembling the symbols bit by bit.
  *
- * @returns  0 on success, -1 otherwise.
+ * @returns  None
  */
-ws2811_return_t ws2811_init(ws2811_t *ws2811)
+static void symbol_lut_init(void)
 {
-    ws2811_device_t *device;
-    const rpi_hw_t *rpi_hw;
-    int chan;
+    int value, bit;
 
-    ws2811->rpi_hw = rpi_hw_detect();
-    if (!ws2811->rpi_hw)
+    if (symbol_lut[0xff])
     {
-        return WS2811_ERROR_HW_NOT_SUPPORTED;
+        return;
     }
-    rpi_hw = ws2811->rpi_hw;
 
-    ws2811->device = malloc(sizeof(*ws2811->device));
-    if (!ws2811->device)
+    for (value = 0; value < 256; value++)
     {
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        uint32_t symbols = 0;
+
+        for (bit = 7; bit >= 0; bit--)
+        {
+            symbols = (symbols << 3) | ((value & (1 << bit)) ? SYMBOL_HIGH : SYMBOL_LOW);
+        }
+
+        symbol_lut[value] = symbols;
     }
-    device = ws2811->device;
+}
 
-    if (check_hwver_and_gpionum(ws2811) < 0)
+/**
+ * Store one 32-bit word of symbols in the raw buffer.  The DMA buffer is
+ * mapped uncached, so this is done with a single write per word.
+ *
+ * @param    writer  Output stream.
+ * @param    word    Symbols, first one in bit 31.
+ *
+ * @returns  None
+ */
+static inline void symbol_store(symbol_writer_t *writer, uint32_t word)
+{
+    if (writer->byteptr)  // SPI
     {
-        return WS2811_ERROR_ILLEGAL_GPIO;
+        writer->byteptr[0] = word >> 24;
+        writer->byteptr[1] = word >> 16;
+        writer->byteptr[2] = word >> 8;
+        writer->byteptr[3] = word;
+        writer->byteptr += 4;
     }
-
-    device->max_count = max_channel_led_count(ws2811);
-
-    if (device->driver_mode == SPI) {
-        return spi_init(ws2811);
+    else  // PWM & PCM
+    {
+        *writer->wordptr = word;
+        writer->wordptr += writer->stride;
     }
+}
 
-    // Determine how much physical memory we need for DMA
-    switch (device->driver_mode) {
-    case PWM:
-        device->mbox.size = PWM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
-
-    case PCM:
-        device->mbox.size = PCM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
-    }
-    // Round up to page size multiple
-    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+/**
+ * Append the 24 symbol bits of one color byte to the output stream.
+ *
+ * @param    writer   Output stream.
+ * @param    symbols  Symbols in the low 24 bits, first one in bit 23.
+ *
+ * @returns  None
+ */
+static inline void symbol_put(symbol_writer_t *writer, uint32_t symbols)
+{
+    writer->acc |= (uint64_t)symbols << (40 - writer->bits);
+    writer->bits += 24;
 
-    device->mbox.handle = mbox_open();
-    if (device->mbox.handle == -1)
+    if (writer->bits >= 32)
     {
-        return WS2811_ERROR_MAILBOX_DEVICE;
+        symbol_store(writer, writer->acc >> 32);
+        writer->acc <<= 32;
+        writer->bits -= 32;
     }
+}
 
-    device->mbox.mem_ref = mem_alloc(device->mbox.handle, device->mbox.size, PAGE_SIZE,
-                                     rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
-    if (device->mbox.mem_ref == 0)
+/**
+ * Store any bits left over at the end of the stream, padded with zeros.
+ *
+ * @param    writer   Output stream.
+ *
+ * @returns  None
+ */
+static void symbol_flush(symbol_writer_t *writer)
+{
+    if (writer->bits)
     {
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        symbol_store(writer, writer->acc >> 32);
+        writer->acc = 0;
+        writer->bits = 0;
     }
+}
 
-    device->mbox.bus_addr = mem_lock(device->mbox.handle, device->mbox.mem_ref);
-    if (device->mbox.bus_addr == (uint32_t) ~0UL)
+/**
+ * Encode the palette colors of a channel into symbols once, with the
+ * channel brightness, color order and inversion applied, so indexed frames
+ * only copy symbols per LED.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
+ *
+ * @returns  None
+ */
+static void palette_encode(ws2811_t *ws2811, int chan)
+{
+    ws2811_palette_t *palette = ws2811->device->palette[chan];
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    const int scale = (channel->brightness & 0xff) + 1;
+    uint8_t shift[LED_COLOURS] = { channel->rshift, channel->gshift, channel->bshift, channel->wshift };
+    uint32_t invert = 0;
+    int i, j;
+
+    if ((ws2811->device->driver_mode != PWM) && channel->invert)
     {
-       mem_free(device->mbox.handle, device->mbox.size);
-       return WS2811_ERROR_MEM_LOCK;
+        invert = 0xffffff;
     }
 
-    device->mbox.virt_addr = mapmem(BUS_TO_PHYS(device->mbox.bus_addr), device->mbox.size);
-    if (!device->mbox.virt_addr)
+    for (i = 0; i < WS2811_PALETTE_SIZE; i++)
     {
-        mem_unlock(device->mbox.handle, device->mbox.mem_ref);
-        mem_free(device->mbox.handle, device->mbox.size);
+        for (j = 0; j < LED_COLOURS; j++)
+        {
+            uint8_t color = palette->colors[i] >> shift[j];
 
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MMAP;
+            palette->symbols[i][j] = symbol_lut[(color * scale) >> 8] ^ invert;
+        }
+    }
+
+    palette->strip_type = channel->strip_type;
+    palette->invert = channel->invert;
+    palette->brightness = channel->brightness;
+}
+
+/**
+ * Encode one channel into the raw DMA/SPI buffer.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
+ * @param    format  WS2811_PIXEL_xxx format of src.
+ * @param    src     Channel count pixels in the given format.
+ *
+ * @returns  Time in microseconds the channel takes to clock out.
+ */
+static uint32_t encode_channel(ws2811_t *ws2811, int chan, int format, const void *src)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    int driver_mode = device->driver_mode;
+    const int scale = (channel->brightness & 0xff) + 1;
+    const ws2811_led_t *leds = src;
+    const uint8_t *bytes = src;
+    int step = pixel_format_size[format];
+    uint8_t shift[4];
+    int offset[4];
+    uint32_t invert = 0;
+    symbol_writer_t writer =
+    {
+        .wordptr = &((volatile uint32_t *)device->pxl_raw)[chan],
+        .stride = (driver_mode == PWM ? 2 : 1),  // Every other word is on the same channel for PWM
+    };
+    int array_size = 3; // Assume 3 color LEDs, RGB
+    int i, j;
+
+    if (!src || !channel->count)
+    {
+        return 0;
+    }
+
+    if (format == WS2811_PIXEL_INDEX8)
+    {
+        ws2811_palette_t *palette = device->palette[chan];
+
+        if (!palette)
+        {
+            return 0;
+        }
+
+        // Symbols only need rebuilding if the channel settings changed since
+        if ((palette->brightness != channel->brightness) ||
+            (palette->strip_type != channel->strip_type) ||
+            (palette->invert != channel->invert))
+        {
+            palette_encode(ws2811, chan);
+        }
+    }
+
+    if (driver_mode == SPI)
+    {
+        writer.byteptr = device->pxl_raw;
+    }
+
+    // Inversion is handled by hardware for PWM, otherwise by software here
+    if ((driver_mode != PWM) && channel->invert)
+    {
+        invert = 0xffffff;
+    }
+
+    // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
+    if (channel->strip_type & SK6812_SHIFT_WMASK)
+    {
+        array_size = 4;
+    }
+
+    // Wire order, the shifts select 0xWWRRGGBB bytes and index the byte formats
+    shift[0] = channel->rshift;
+    shift[1] = channel->gshift;
+    shift[2] = channel->bshift;
+    shift[3] = channel->wshift;
+    for (j = 0; j < 4; j++)
+    {
+        offset[j] = pixel_format_offset[format][(shift[j] >> 3) & 0x3];
+    }
+
+    for (i = 0; i < channel->count; i++)                    // Led
+    {
+        uint8_t color[4];
+
+        if (format == WS2811_PIXEL_INDEX8)
+        {
+            const uint32_t *symbols = device->palette[chan]->symbols[bytes[i]];
+
+            for (j = 0; j < array_size; j++)
+            {
+                symbol_put(&writer, symbols[j]);
+            }
+
+            continue;
+        }
+
+        if (format == WS2811_PIXEL_LED)
+        {
+            for (j = 0; j < array_size; j++)
+            {
+                color[j] = leds[i] >> shift[j];
+            }
+        }
+        else
+        {
+            const uint8_t *pixel = &bytes[i * step];
+
+            for (j = 0; j < array_size; j++)
+            {
+                color[j] = (offset[j] < 0) ? 0 : pixel[offset[j]];
+            }
+        }
+
+        for (j = 0; j < array_size; j++)                    // Color
+        {
+            symbol_put(&writer, symbol_lut[(color[j] * scale) >> 8] ^ invert);
+        }
+    }
+
+    symbol_flush(&writer);
+
+    // 1.25µs per bit
+    return channel->count * array_size * 8 * 1.25;
+}
+
+/**
+ * Wait for the previous frame and the LED reset time, then send the raw
+ * buffer out.
+ *
+ * @param    ws2811         ws2811 instance pointer.
+ * @param    protocol_time  Time in microseconds the new frame takes to clock out.
+ * @param    start_ns       CLOCK_MONOTONIC time in nanoseconds to start at, 0 to
+ *                          start as soon as the LEDs are ready for it.
+ *
+ * @returns  0 on success, error otherwise.
+ */
+static ws2811_return_t start_output(ws2811_t *ws2811, uint32_t protocol_time, uint64_t start_ns)
+{
+    int driver_mode = ws2811->device->driver_mode;
+    ws2811_return_t ret = WS2811_SUCCESS;
+    static uint64_t previous_timestamp = 0;
+
+    // Wait for any previous DMA operation to complete.
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    if (ws2811->render_wait_time != 0) {
+        const uint64_t current_timestamp = get_microsecond_timestamp();
+	uint64_t time_diff = current_timestamp - previous_timestamp;
+
+        if (ws2811->render_wait_time > time_diff) {
+            usleep(ws2811->render_wait_time - time_diff);
+        }
+    }
+
+    if (driver_mode != SPI)
+    {
+        // The reset takes a couple of sleeps, keep them out of the timed start
+        dma_prepare(ws2811);
+    }
+
+    if (start_ns)
+    {
+        wait_until(start_ns);
+    }
+
+    if (driver_mode != SPI)
+    {
+        dma_start(ws2811);
+    }
+
+    if (start_ns)
+    {
+        // The SPI transfer blocks until it's done, so measure before it
+        ws2811->render_error_ns = (int64_t)(get_nanosecond_timestamp() - start_ns);
+    }
+
+    if (driver_mode == SPI)
+    {
+        ret = spi_transfer(ws2811);
+    }
+
+    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
+    previous_timestamp = get_microsecond_timestamp();
+    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+
+    return ret;
+}
+
+
+/**
+ * Encode the frame into the DMA buffer and start the output.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    format    One of the WS2811_PIXEL_xxx formats.
+ * @param    pixels    Per channel pixel data, or NULL to use the channel LEDs.
+ * @param    start_ns  CLOCK_MONOTONIC time in nanoseconds to start the output,
+ *                     0 to start it as soon as the LEDs are ready.
+ *
+ * @returns  0 on success, error otherwise.
+ */
+static ws2811_return_t render_pixels(ws2811_t *ws2811, int format, const uint8_t *const *pixels,
+                                     uint64_t start_ns)
+{
+    uint32_t protocol_time = 0;
+    int chan;
+
+    if ((format < WS2811_PIXEL_LED) || (format > WS2811_PIXEL_INDEX8))
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if ((format == WS2811_PIXEL_INDEX8) && pixels && pixels[chan] &&
+            !ws2811->device->palette[chan])
+        {
+            return WS2811_ERROR_GENERIC;   // Indexed frame without a palette
+        }
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    {
+        uint32_t channel_protocol_time;
+
+        if (pixels && pixels[chan])
+        {
+            channel_protocol_time = encode_channel(ws2811, chan, format, pixels[chan]);
+        }
+        else
+        {
+            channel_protocol_time = encode_channel(ws2811, chan, WS2811_PIXEL_LED,
+                __atomic_load_n(&ws2811->channel[chan].leds, __ATOMIC_ACQUIRE));
+        }
+
+        // Only using the channel which takes the longest as both run in parallel
+        if (channel_protocol_time > protocol_time)
+        {
+            protocol_time = channel_protocol_time;
+        }
+    }
+
+    return start_output(ws2811, protocol_time, start_ns);
+}
+
+
+/*
+ *
+ * Application API Functions
+ *
+ */
+
+
+/**
+ * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_init(ws2811_t *ws2811)
+{
+    ws2811_device_t *device;
+    ws2811_return_t ret;
+    int chan;
+
+    ws2811->rpi_hw = rpi_hw_detect();
+    if (!ws2811->rpi_hw)
+    {
+        return WS2811_ERROR_HW_NOT_SUPPORTED;
+    }
+
+    symbol_lut_init();
+
+    ws2811->device = malloc(sizeof(*ws2811->device));
+    if (!ws2811->device)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device = ws2811->device;
+
+    if (check_hwver_and_gpionum(ws2811) < 0)
+    {
+        return WS2811_ERROR_ILLEGAL_GPIO;
+    }
+
+    device->max_count = max_channel_led_count(ws2811);
+
+    if (device->driver_mode == SPI) {
+        return spi_init(ws2811);
+    }
+
+    // Determine how much physical memory we need for DMA
+    device->mbox.size = videocore_buffer_size(ws2811, device->max_count);
+
+    device->mbox.handle = mbox_open();
+    if (device->mbox.handle == -1)
+    {
+        return WS2811_ERROR_MAILBOX_DEVICE;
+    }
+
+    if ((ret = videocore_alloc(ws2811, &device->mbox)) != WS2811_SUCCESS)
+    {
+        mbox_close(device->mbox.handle);
+        device->mbox.handle = -1;
+        return ret;
     }
 
     // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
     device->pxl_raw = NULL;
     device->dma_cb = NULL;
+    device->periph = NULL;
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         ws2811->channel[chan].leds = NULL;
+        device->leds_alloc[chan] = NULL;
+        device->palette[chan] = NULL;
     }
 
     // Allocate the LED buffers
@@ -935,6 +1517,7 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
         ws2811_channel_t *channel = &ws2811->channel[chan];
 
         channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
+        device->leds_alloc[chan] = channel->leds;
         if (!channel->leds)
         {
             ws2811_cleanup(ws2811);
@@ -943,16 +1526,7 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
 
         memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
 
-        if (!channel->strip_type)
-        {
-          channel->strip_type=WS2811_STRIP_RGB;
-        }
-
-        channel->wshift = (channel->strip_type >> 24) & 0xff;
-        channel->rshift = (channel->strip_type >> 16) & 0xff;
-        channel->gshift = (channel->strip_type >> 8)  & 0xff;
-        channel->bshift = (channel->strip_type >> 0)  & 0xff;
-
+        channel_set_shifts(channel);
     }
 
     device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
@@ -1009,6 +1583,8 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
         break;
     }
 
+    device_save_config(ws2811);
+
     return WS2811_SUCCESS;
 }
 
@@ -1040,177 +1616,325 @@ void ws2811_fini(ws2811_t *ws2811)
 }
 
 /**
- * Wait for any executing DMA operation to complete before returning.
+ * Apply changed LED counts, strip types and output frequency to an already
+ * initialized instance without tearing it down.  The VideoCore buffer is
+ * reused when it is still large enough and the clock and DMA setup is only
+ * redone when the output timing changed, so the LEDs don't blank.  Changing
+ * the GPIO pins or DMA channel needs the hardware set up from scratch, which
+ * would drop buffers attached with ws2811_set_leds(), so that is left to the
+ * caller: the instance is left as it was and WS2811_ERROR_REINIT_NEEDED is
+ * returned.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  0 on success, -1 on DMA competion error
+ * @returns  0 on success, error otherwise.
  */
-ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+ws2811_return_t ws2811_reconfigure(ws2811_t *ws2811)
 {
-    volatile dma_t *dma = ws2811->device->dma;
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+    int timing_changed = 0;
+    int max_count;
+    uint32_t size;
+    int chan;
 
-    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    if (!device)
     {
-        return WS2811_SUCCESS;
+        return WS2811_ERROR_GENERIC;
     }
 
-    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
-           !(dma->cs & RPI_DMA_CS_ERROR))
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        usleep(10);
+        if ((ws2811->channel[chan].gpionum != device->gpionum[chan]) ||
+            (ws2811->dmanum != device->dmanum))
+        {
+            return WS2811_ERROR_REINIT_NEEDED;
+        }
+
+        if ((ws2811->channel[chan].invert != device->invert[chan]) &&
+            (device->driver_mode == PWM))
+        {
+            timing_changed = 1;  // Inversion is done by the PWM hardware
+        }
     }
 
-    if (dma->cs & RPI_DMA_CS_ERROR)
+    if (ws2811->freq != device->freq)
     {
-        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
-        return WS2811_ERROR_DMA;
+        timing_changed = 1;
     }
 
-    return WS2811_SUCCESS;
-}
-
-/**
- * Render the DMA buffer from the user supplied LED arrays and start the DMA
- * controller.  This will update all LEDs on both PWM channels.
- *
- * @param    ws2811  ws2811 instance pointer.
- *
- * @returns  None
- */
-ws2811_return_t  ws2811_render(ws2811_t *ws2811)
-{
-    volatile uint8_t *pxl_raw = ws2811->device->pxl_raw;
-    int driver_mode = ws2811->device->driver_mode;
-    int bitpos;
-    int i, k, l, chan;
-    unsigned j;
-    ws2811_return_t ret = WS2811_SUCCESS;
-    uint32_t protocol_time = 0;
-    static uint64_t previous_timestamp = 0;
-
-    bitpos = (driver_mode == SPI ? 7 : 31);
+    // Let the current frame finish before touching any buffers
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    // Only the driver's own buffers are resized, attached buffers are sized by the application
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
+        int old_count = device->count[chan];
 
-        int wordpos = chan; // PWM & PCM
-        int bytepos = 0;    // SPI
-        const int scale = (channel->brightness & 0xff) + 1;
-        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+        if ((channel->count != old_count) && (channel->count > 0))
+        {
+            ws2811_led_t *leds = realloc(device->leds_alloc[chan], sizeof(ws2811_led_t) * channel->count);
 
-        // 1.25µs per bit
-        const uint32_t channel_protocol_time = channel->count * array_size * 8 * 1.25;
+            if (!leds)
+            {
+                return WS2811_ERROR_OUT_OF_MEMORY;
+            }
 
-        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
-        if (channel->strip_type & SK6812_SHIFT_WMASK)
-        {
-            array_size = 4;
+            if (channel->count > old_count)
+            {
+                memset(&leds[old_count], 0, sizeof(ws2811_led_t) * (channel->count - old_count));
+            }
+
+            if (channel->leds == device->leds_alloc[chan])
+            {
+                channel->leds = leds;
+            }
+            device->leds_alloc[chan] = leds;
         }
+        device->count[chan] = channel->count;
 
-        // Only using the channel which takes the longest as both run in parallel
-        if (channel_protocol_time > protocol_time)
+        channel_set_shifts(channel);
+    }
+
+    max_count = max_channel_led_count(ws2811);
+
+    if (device->driver_mode == SPI)
+    {
+        uint8_t *pxl_raw = realloc((uint8_t *)device->pxl_raw, PCM_BYTE_COUNT(max_count, ws2811->freq));
+
+        if (!pxl_raw)
         {
-            protocol_time = channel_protocol_time;
+            return WS2811_ERROR_OUT_OF_MEMORY;
         }
+        device->pxl_raw = pxl_raw;
+        device->max_count = max_count;
+        pcm_raw_init(ws2811);
 
-        for (i = 0; i < channel->count; i++)                // Led
+        if (timing_changed)
         {
-            uint8_t color[] =
-            {
-                (((channel->leds[i] >> channel->rshift) & 0xff) * scale) >> 8, // red
-                (((channel->leds[i] >> channel->gshift) & 0xff) * scale) >> 8, // green
-                (((channel->leds[i] >> channel->bshift) & 0xff) * scale) >> 8, // blue
-                (((channel->leds[i] >> channel->wshift) & 0xff) * scale) >> 8, // white
-            };
+            uint32_t speed = ws2811->freq * 3;
 
-            for (j = 0; j < array_size; j++)               // Color
+            if (ioctl(device->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
             {
-                for (k = 7; k >= 0; k--)                   // Bit
-                {
-                    // Inversion is handled by hardware for PWM, otherwise by software here
-                    uint8_t symbol = SYMBOL_LOW;
-                    if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_LOW_INV;
-
-                    if (color[j] & (1 << k))
-                    {
-                        symbol = SYMBOL_HIGH;
-                        if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_HIGH_INV;
-                    }
-
-                    for (l = 2; l >= 0; l--)               // Symbol
-                    {
-                        uint32_t *wordptr = &((uint32_t *)pxl_raw)[wordpos];   // PWM & PCM
-                        volatile uint8_t  *byteptr = &pxl_raw[bytepos];    // SPI
-
-                        if (driver_mode == SPI)
-                        {
-                            *byteptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *byteptr |= (1 << bitpos);
-                            }
-			}
-			else  // PWM & PCM
-			{
-                            *wordptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *wordptr |= (1 << bitpos);
-                            }
-                        }
-
-                        bitpos--;
-                        if (bitpos < 0)
-                        {
-                            if (driver_mode == SPI)
-                            {
-                                bytepos++;
-                                bitpos = 7;
-                            }
-                            else  // PWM & PCM
-                            {
-                                // Every other word is on the same channel for PWM
-                                wordpos += (driver_mode == PWM ? 2 : 1);
-                                bitpos = 31;
-                            }
-                        }
-                    }
-                }
+                return WS2811_ERROR_SPI_SETUP;
             }
         }
+
+        device_save_config(ws2811);
+
+        return WS2811_SUCCESS;
     }
 
-    // Wait for any previous DMA operation to complete.
-    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    // Only go back to the mailbox if the current buffer is too small
+    size = videocore_buffer_size(ws2811, max_count);
+    if (size > device->mbox.size)
     {
-        return ret;
+        videocore_mbox_t mbox = device->mbox;
+
+        mbox.size = size;
+        if ((ret = videocore_alloc(ws2811, &mbox)) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+
+        // The DMA engine is idle, so the old buffer can go
+        videocore_free(&device->mbox);
+        device->mbox = mbox;
+
+        device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
+        device->pxl_raw = (uint8_t *)device->mbox.virt_addr + sizeof(dma_cb_t);
+        memset((dma_cb_t *)device->dma_cb, 0, sizeof(dma_cb_t));
+        device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
+
+        timing_changed = 1;  // Control block needs to be rebuilt
     }
 
-    if (ws2811->render_wait_time != 0) {
-        const uint64_t current_timestamp = get_microsecond_timestamp();
-	uint64_t time_diff = current_timestamp - previous_timestamp;
+    device->max_count = max_count;
 
-        if (ws2811->render_wait_time > time_diff) {
-            usleep(ws2811->render_wait_time - time_diff);
+    switch (device->driver_mode) {
+    case PWM:
+        pwm_raw_init(ws2811);
+
+        if (timing_changed && setup_pwm(ws2811))
+        {
+            return WS2811_ERROR_PWM_SETUP;
+        }
+        device->dma_cb->txfr_len = PWM_BYTE_COUNT(max_count, ws2811->freq);
+        break;
+
+    case PCM:
+        pcm_raw_init(ws2811);
+
+        if (timing_changed && setup_pcm(ws2811))
+        {
+            return WS2811_ERROR_PCM_SETUP;
         }
+        device->dma_cb->txfr_len = PCM_BYTE_COUNT(max_count, ws2811->freq);
+        break;
     }
 
-    if (driver_mode != SPI)
+    device_save_config(ws2811);
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Attach an application owned LED buffer to a channel, so the encoder reads
+ * the frame straight from application memory instead of it being copied into
+ * the driver buffer.  The pointer is swapped atomically, which lets a producer
+ * double buffer by handing over the next frame while a render is running on
+ * another thread.  The buffer must hold at least channel count LEDs and stay
+ * valid until it is replaced or ws2811_fini() is called.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
+ * @param    leds    Buffer to attach, NULL to go back to the driver buffer.
+ *
+ * @returns  The previously attached buffer, NULL on error.
+ */
+ws2811_led_t *ws2811_set_leds(ws2811_t *ws2811, int chan, ws2811_led_t *leds)
+{
+    if (!ws2811->device || (chan < 0) || (chan >= RPI_PWM_CHANNELS))
     {
-        dma_start(ws2811);
+        return NULL;
     }
-    else
+
+    if (!leds)
     {
-        ret = spi_transfer(ws2811);
+        leds = ws2811->device->leds_alloc[chan];
     }
 
-    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
-    previous_timestamp = get_microsecond_timestamp();
-    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+    return __atomic_exchange_n(&ws2811->channel[chan].leds, leds, __ATOMIC_ACQ_REL);
+}
 
-    return ret;
+/**
+ * Set the palette used for WS2811_PIXEL_INDEX8 frames on a channel.  The
+ * colors are encoded into symbols here, so rendering an indexed frame costs
+ * a table copy per LED and cycling palette colors costs nothing per pixel.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    chan     Channel number.
+ * @param    colors   Palette colors, 0xWWRRGGBB.
+ * @param    count    Number of colors, up to WS2811_PALETTE_SIZE.
+ *
+ * @returns  0 on success, error otherwise.
+ */
+ws2811_return_t ws2811_set_palette(ws2811_t *ws2811, int chan, const ws2811_led_t *colors, int count)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_palette_t *palette;
+
+    if (!device || (chan < 0) || (chan >= RPI_PWM_CHANNELS) ||
+        (count < 0) || (count > WS2811_PALETTE_SIZE))
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    palette = device->palette[chan];
+    if (!palette)
+    {
+        palette = calloc(1, sizeof(*palette));
+        if (!palette)
+        {
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+        device->palette[chan] = palette;
+    }
+
+    // Unused entries render as off
+    memset(palette->colors, 0, sizeof(palette->colors));
+    memcpy(palette->colors, colors, sizeof(ws2811_led_t) * count);
+
+    palette_encode(ws2811, chan);
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Wait for any executing DMA operation to complete before returning.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+{
+    volatile dma_t *dma = ws2811->device->dma;
+
+    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    {
+        return WS2811_SUCCESS;
+    }
+
+    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
+           !(dma->cs & RPI_DMA_CS_ERROR))
+    {
+        usleep(10);
+    }
+
+    if (dma->cs & RPI_DMA_CS_ERROR)
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
+        return WS2811_ERROR_DMA;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Render the DMA buffer from the user supplied LED arrays and start the DMA
+ * controller.  This will update all LEDs on both PWM channels.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+{
+    return ws2811_render_pixels(ws2811, WS2811_PIXEL_LED, NULL);
+}
+
+/**
+ * Render the DMA buffer from the user supplied LED arrays right away, but
+ * hold off starting the DMA controller until the given time.  The time the
+ * output actually started at, less the time asked for, is left in
+ * render_error_ns.  Times already past start the output as soon as possible.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    start_ns  CLOCK_MONOTONIC time in nanoseconds to start the output,
+ *                     0 to start it now, like ws2811_render(), with no error.
+ *
+ * @returns  0 on success, error otherwise.
+ */
+ws2811_return_t ws2811_render_at(ws2811_t *ws2811, uint64_t start_ns)
+{
+    if (!start_ns)
+    {
+        ws2811->render_error_ns = 0;
+    }
+
+    return render_pixels(ws2811, WS2811_PIXEL_LED, NULL, start_ns);
+}
+
+/**
+ * Render packed pixel byte streams instead of the ws2811_led_t channel
+ * buffers.  The bytes are unpacked by the encoder as it goes, so no
+ * intermediate LED array is built.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    format  One of the WS2811_PIXEL_xxx formats.
+ * @param    pixels  Per channel pixel data holding channel count pixels, or
+ *                   NULL (for the array or an entry) to use the channel LEDs.
+ *
+ * @returns  0 on success, error otherwise.
+ */
+ws2811_return_t ws2811_render_pixels(ws2811_t *ws2811, int format, const uint8_t *const *pixels)
+{
+    return render_pixels(ws2811, format, pixels, 0);
 }
 
 const char * ws2811_get_return_t_str(const ws2811_return_t state)
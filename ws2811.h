@@ -63,6 +63,15 @@ extern "C" {
 #define SK6812_STRIP                             WS2811_STRIP_GRB
 #define SK6812W_STRIP                            SK6812_STRIP_GRBW
 
+// Pixel layouts accepted by ws2811_render_pixels()
+#define WS2811_PIXEL_LED                         0        // ws2811_led_t, 0xWWRRGGBB
+#define WS2811_PIXEL_RGB888                      1        // 3 bytes per LED, R G B
+#define WS2811_PIXEL_GRB888                      2        // 3 bytes per LED, G R B
+#define WS2811_PIXEL_RGBW8888                    3        // 4 bytes per LED, R G B W
+#define WS2811_PIXEL_INDEX8                      4        // 1 byte per LED, index into the channel palette
+
+#define WS2811_PALETTE_SIZE                      256
+
 struct ws2811_device;
 
 typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
@@ -73,6 +82,7 @@ typedef struct
     int count;                                   //< Number of LEDs, 0 if channel is unused
     int strip_type;                              //< Strip color layout -- one of WS2811_STRIP_xxx constants
     ws2811_led_t *leds;                          //< LED buffers, allocated by driver based on count
+                                                 //< or attached with ws2811_set_leds()
     uint8_t brightness;                          //< Brightness value between 0 and 255
     uint8_t wshift;                              //< White shift value
     uint8_t rshift;                              //< Red shift value
@@ -88,6 +98,7 @@ typedef struct
     uint32_t freq;                               //< Required output frequency
     int dmanum;                                  //< DMA number _not_ already in use
     ws2811_channel_t channel[RPI_PWM_CHANNELS];
+    int64_t render_error_ns;                     //< Start of the last ws2811_render_at() less the time asked for
 } ws2811_t;
 
 #define WS2811_RETURN_STATES(X)                                                             \
@@ -105,7 +116,8 @@ typedef struct
             X(-11, WS2811_ERROR_ILLEGAL_GPIO, "Selected GPIO not possible"),                \
             X(-12, WS2811_ERROR_PCM_SETUP, "Unable to initialize PCM"),                     \
             X(-13, WS2811_ERROR_SPI_SETUP, "Unable to initialize SPI"),                     \
-            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error")                         \
+            X(-14, WS2811_ERROR_SPI_TRANSFER, "SPI transfer error"),                        \
+            X(-15, WS2811_ERROR_REINIT_NEEDED, "Pins or DMA changed, needs re-init")        \
 
 #define WS2811_RETURN_STATES_ENUM(state, name, str) name = state
 #define WS2811_RETURN_STATES_STRING(state, name, str) str
@@ -118,8 +130,15 @@ typedef enum {
 
 ws2811_return_t ws2811_init(ws2811_t *ws2811);                         //< Initialize buffers/hardware
 void ws2811_fini(ws2811_t *ws2811);                                    //< Tear it all down
+ws2811_return_t ws2811_reconfigure(ws2811_t *ws2811);                  //< Apply changed counts/strip types/freq in place
 ws2811_return_t ws2811_render(ws2811_t *ws2811);                       //< Send LEDs off to hardware
+ws2811_return_t ws2811_render_at(ws2811_t *ws2811, uint64_t start_ns); //< Send LEDs off at a CLOCK_MONOTONIC time
+ws2811_return_t ws2811_render_pixels(ws2811_t *ws2811, int format,
+                                     const uint8_t *const *pixels);    //< Send packed pixel bytes off to hardware
 ws2811_return_t ws2811_wait(ws2811_t *ws2811);                         //< Wait for DMA completion
+ws2811_led_t *ws2811_set_leds(ws2811_t *ws2811, int chan, ws2811_led_t *leds); //< Attach a caller owned LED buffer
+ws2811_return_t ws2811_set_palette(ws2811_t *ws2811, int chan, const ws2811_led_t *colors,
+                                   int count);                         //< Set the palette for indexed frames
 const char * ws2811_get_return_t_str(const ws2811_return_t state);     //< Get string representation of the given return state
 
 #ifdef __cplusplus